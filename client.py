@@ -1,25 +1,78 @@
-from time import sleep
+from concurrent.futures import ThreadPoolExecutor
+from time import perf_counter
 import socket
 import random
 import os
 
 # possible operation requests
 BACKUP_FILE = 100
+BACKUP_FILE_CHECKED = 101  # the payload is followed by its CRC32C, the server rejects a mismatch
 GET_FILE = 200
 ERASE_FILE = 201
 GET_BACKUP_LIST = 202
+VERIFY_BACKUP = 203
+ERASE_FILES = 204
+GET_SERVER_STATS = 205
+GET_FILE_VERSIONS = 206
 
 # return codes
 return_codes = {'GET_FILE_SUCCESS': 210,  # get file from backup was successful
                 'GET_BACKUP_LIST_SUCCESS': 211,  # get list of backed files was successful
                 'BACKUP_FILE_OR_ERASE_FILE_SUCCESS': 212,  # backup or erase of file was successful
+                'VERIFY_BACKUP_SUCCESS': 213,  # all backed up files match their checksums
+                'GET_SERVER_STATS_SUCCESS': 214,  # server's metrics were sent
+                'GET_FILE_VERSIONS_SUCCESS': 215,  # versions of a file were sent
                 'FILE_NOT_FOUND': 1001,  # backup directory does not have this file
                 'NO_FILES_FOR_CLIENT': 1002,  # backup directory for this user is empty
-                'GENERAL_ERROR': 1003}  # general problem with the server
+                'GENERAL_ERROR': 1003,  # general problem with the server
+                'CHECKSUM_MISMATCH': 1004}  # at least one backed up file does not match its checksum
 
 
-# chunk size for sending\receiving via sockets
-buffer_size = 1024
+# chunk size for receiving via sockets (files are sent with socket.sendfile)
+buffer_size = 256 * 1024
+
+# version of the protocol that the client speaks. version 2 sends the as-of field of GET_FILE
+protocol_version = 2
+
+# number of files that are transferred at the same time by backup_files / get_files
+transfer_workers = 4
+
+# size of the CRC32C that follows the payload of a GET_FILE response and of a BACKUP_FILE_CHECKED request
+checksum_size = 4
+
+
+def _make_crc32c_table():
+    table = []
+    for i in range(256):
+        crc = i
+        for _ in range(8):
+            crc = (crc >> 1) ^ (0x82F63B78 if crc & 1 else 0)
+        table.append(crc)
+    return table
+
+
+try:
+    from crc32c import crc32c  # native implementation, if installed
+    native_crc32c = True
+except ImportError:
+    native_crc32c = False
+    _crc32c_table = _make_crc32c_table()
+
+    def crc32c(data: bytes, crc: int = 0) -> int:
+        """
+        continue the CRC32C (Castagnoli) of a stream with the next chunk of data
+        :param data: the next chunk
+        :param crc: the CRC32C of the previous chunks, 0 for the first one
+        :return: the updated CRC32C
+        """
+        crc ^= 0xFFFFFFFF
+        for b in data:
+            crc = (crc >> 8) ^ _crc32c_table[(crc ^ b) & 0xFF]
+        return crc ^ 0xFFFFFFFF
+
+# compare the CRC32C of every transfer with the one of the server. the pure Python
+# CRC32C runs at a few MB/s, so without the crc32c package this is off unless set to True
+verify_checksums = native_crc32c
 
 
 def translate(code: int):
@@ -60,13 +113,14 @@ class MySocket:
         self.backup_list = self.get_backup_local_files_list()
 
         # server's response header will be saved here
-        self.version = 1  # 1 byte
+        self.version = protocol_version  # 1 byte
         self.status = 0  # status code from server
         self.name_len = ''  # 2 bytes
         self.filename = ''  # without null termination
         # payload fields
         self.size = 0  # 4 bytes
         self.payload = None
+        self.checksum = 0  # CRC32C of the last file that was sent or received
 
     def get_server_info(self):
         """
@@ -117,27 +171,58 @@ class MySocket:
         print("Closing connection")
         self.sock.close()
 
+    def recv_exact(self, size: int) -> bytes:
+        """
+        receive exactly size bytes from the server
+        :param size: number of bytes to receive
+        :return: the received bytes
+        :raises ConnectionError: if the server closed the connection before
+        """
+        buf = bytearray(size)
+        view = memoryview(buf)
+        received = 0
+        while received < size:
+            n = self.sock.recv_into(view[received:], size - received)
+            if n == 0:
+                raise ConnectionError(f'connection closed after {received} of {size} bytes')
+            received += n
+        return bytes(buf)
+
+    def recv_all(self) -> bytes:
+        """
+        receive the rest of the payload, until the server closes the connection
+        :return: the received bytes
+        """
+        data = bytearray()
+        buf = bytearray(buffer_size)
+        view = memoryview(buf)
+        while True:
+            n = self.sock.recv_into(view)
+            if n == 0:
+                return bytes(data)
+            data += view[:n]
+
     def recv_response(self):
         """
-        receive back the response message from the server
+        receive back the response message from the server.
+        the header is version (1B), status (2B), name_len (2B), filename and size (4B)
         :return:
         """
-        response = self.sock.recv(buffer_size)
-        # parse the response message
-        self.version = response[0]
-        self.status = int.from_bytes(response[1: 3], 'little')
-
-        # if name_len is included - parse it
-        if len(response) > 4:
+        try:
+            response = self.recv_exact(5)
+            self.version = response[0]
+            self.status = int.from_bytes(response[1: 3], 'little')
             self.name_len = int.from_bytes(response[3: 5], 'little')
 
-        # if filename and size are included - parse them
-        if len(response) > 6:
-            self.filename = response[5: 5 + self.name_len]
-            self.size = int.from_bytes(response[5 + self.name_len: 9 + self.name_len], 'little')
+            response = self.recv_exact(self.name_len + 4)
+            self.filename = response[0: self.name_len]
+            self.size = int.from_bytes(response[self.name_len:], 'little')
+        except (socket.error, ConnectionError) as exc:
+            print(f'Socket connection is broken, {exc}')
+            self.status = 0
+            return
 
         print(f"Server's response code: {translate(self.status)}")
-        # print(f'response sequence:\n{response}')
 
     def header(self, operation=0, name_len=0, filename="") -> bytes:
         """
@@ -151,69 +236,81 @@ class MySocket:
             raise ValueError('operation is illegal')
 
         h = self.userid.to_bytes(4, 'little')
-        h += self.version.to_bytes(1, 'little')
+        h += protocol_version.to_bytes(1, 'little')
         h += operation.to_bytes(1, 'little')
         h += name_len.to_bytes(2, 'little')
         h += filename.encode('utf-8')
         return h
 
-    def send_file(self, fh):
+    def send_file(self, fh) -> int:
         """
-        reads the file content on chunks and sends them till
-        the end of the file
+        sends the file with socket.sendfile (zero copy where the OS supports it).
+        when checksums are verified the file is read once into a preallocated buffer instead,
+        and its CRC32C (self.checksum) is computed from the same chunks that are sent
         :param fh: file handle
+        :return: number of bytes sent
         """
         print('Sending file...')
-        chunk = True
-
-        while chunk:
-            chunk = fh.read(buffer_size)
-            if chunk:
-                try:
-                    self.sock.sendall(chunk)
-                except socket.error as exc:
-                    print(f'Socket connection is broken, {exc} , terminating client')
-                    return
+        self.checksum = 0
+        sent = 0
+        try:
+            if not verify_checksums:
+                sent = self.sock.sendfile(fh)
+            else:
+                buf = bytearray(buffer_size)
+                view = memoryview(buf)
+                n = fh.readinto(buf)
+                while n:
+                    self.sock.sendall(view[:n])
+                    self.checksum = crc32c(view[:n], self.checksum)
+                    sent += n
+                    n = fh.readinto(buf)
+        except socket.error as exc:
+            print(f'Socket connection is broken, {exc} , terminating client')
+            return 0
         print('Done sending')
+        return sent
 
-    def receive_file(self, fh, file_size: int):
+    def receive_file(self, fh, file_size: int) -> int:
         """
-        receives chunks of file from server. the chunks will
-        be written to the fh file descriptor
+        receives the file from server into a preallocated buffer and writes it to fh.
+        the file is followed by its CRC32C, which is saved in self.payload.
+        when checksums are verified, the CRC32C of the received bytes is saved in self.checksum
         :param file_size: the size of the file to receive
         :param fh: file handle (file descriptor)
         :return: total number of bytes received
         """
         print(f'Attempting to receive file size: {file_size} bytes')
         print('Receiving file...')
+        buf = bytearray(min(buffer_size, max(file_size, 1)))
+        view = memoryview(buf)
         size = 0
+        self.checksum = 0
+        self.payload = None
 
-        while size <= file_size:
-            try:
-                chunk = self.sock.recv(buffer_size)
-                size += len(chunk)
-
-                if size <= file_size:
-                    fh.write(chunk)
-
-                else:
-                    # reached the last chunk that contributes more than file_size.
-                    # hence, write only the bytes to equalize to file_size
-                    fh.write(chunk[0: len(chunk) - (size - file_size)])
-                    size -= (size - file_size)
+        try:
+            while size < file_size:
+                n = self.sock.recv_into(view, min(len(buf), file_size - size))
+                if n == 0:
                     break
+                fh.write(view[:n])
+                if verify_checksums:
+                    self.checksum = crc32c(view[:n], self.checksum)
+                size += n
+
+            if size == file_size:
+                self.payload = int.from_bytes(self.recv_exact(checksum_size), 'little')
+        except (socket.error, ConnectionError) as exc:
+            print(f'Socket connection is broken, {exc} , terminating client')
 
-            except socket.error as exc:
-                print(f'Socket connection is broken, {exc} , terminating client')
-                return size
         print('Done receiving')
         return size
 
-    def backup_file(self, filename: str):
+    def backup_file(self, filename: str) -> float:
         """
         backup file request
         :param filename: the file path to backup
-        :return:
+        :return: throughput in MB/s, 0 if the backup failed
         """
         print(f"Request to backup file: {filename}")
 
@@ -224,45 +321,50 @@ class MySocket:
             return
 
         # make sure the file is not empty
-        try:
-            chunk = fh.read(buffer_size)
-            if not chunk:
-                raise RuntimeError
-        except RuntimeError:
+        file_size = os.fstat(fh.fileno()).st_size
+        if file_size == 0:
             print(f'File {filename} is empty. Terminating backup operation')
             fh.close()
-            return
-        fh.seek(0)  # return the pointer to the begining of the file
+            return 0
 
-        file_size = os.stat(filename).st_size
         if file_size >= (2 ** 32):
             print(f"File size is to large: {file_size} bytes. Aborting request")
             fh.close()
-            return
+            return 0
         print(f"Sending file size: {file_size} bytes")
 
-        # construct header
-        msg_header = self.header(BACKUP_FILE, name_len=len(filename), filename=filename)
+        # construct header. the server separates the header from the payload by itself
+        # with checksums the server compares the CRC32C that follows the payload with the received bytes
+        operation = BACKUP_FILE_CHECKED if verify_checksums else BACKUP_FILE
+        msg_header = self.header(operation, name_len=len(filename), filename=filename)
+        start = perf_counter()
         self.connect(self._server_host, self._server_port)  # connect to server
         self.sock.sendall(msg_header + file_size.to_bytes(4, 'little'))  # send header + size
 
-        sleep(0.1)  # this delay prevents the merge of header and payload
-        # it is necessary to separate between the two
-
-        self.send_file(fh)  # send the payload
+        if self.send_file(fh) == file_size and verify_checksums:  # send the payload
+            self.sock.sendall(self.checksum.to_bytes(checksum_size, 'little'))
         fh.close()
         self.recv_response()  # receive a response message from the server and exit
+        rate = 0
         if self.status != return_codes['BACKUP_FILE_OR_ERASE_FILE_SUCCESS']:
             print(f'Received error status {translate(self.status)}')
+        elif verify_checksums and self.size != self.checksum:
+            # on success the server returns the CRC32C of the bytes it stored
+            print(f'Warning: Mismatch. Stored checksum {self.size:08x} != sent checksum {self.checksum:08x}')
+        else:
+            rate = report_throughput(filename, file_size, perf_counter() - start)
         self.sock.shutdown(socket.SHUT_WR)  # notify to server that client has finished sending
         self.close()  # close connection
+        return rate
 
-    def get_file(self, filename: str, dest_name: str):
+    def get_file(self, filename: str, dest_name: str, as_of: int = 0) -> float:
         """
         get file request
         :param filename: the file to receive from server
         :param dest_name: the name of the file in client's local directory (destination name)
-        :return:
+        :param as_of: get the version that was backed up at this time (seconds since the epoch),
+                      0 for the latest version
+        :return: throughput in MB/s, 0 if the file was not received
         """
         print(f"Request to get file from server: {filename}")
         print(f'Will be saved locally as: {dest_name}')
@@ -271,33 +373,91 @@ class MySocket:
             fh = open(dest_name, 'wb')
         except Exception as exc:
             print(f'Cannot open {dest_name}, {exc}')
-            return
+            return 0
 
-        # construct header
+        # construct header. the size field selects the version
         msg_header = self.header(GET_FILE, name_len=len(filename), filename=filename)
 
+        start = perf_counter()
         self.connect(self._server_host, self._server_port)  # connect to server
-        self.sock.sendall(msg_header)  # send header
+        self.sock.sendall(msg_header + as_of.to_bytes(4, 'little'))  # send header + version
         self.recv_response()  # receive a response message from the server before receiving file
         if self.status != return_codes['GET_FILE_SUCCESS']:
             print(f'Received error status {translate(self.status)}')
+            fh.close()
             self.sock.shutdown(socket.SHUT_WR)  # notify to server that client has finished sending
             self.close()  # close connection
-            return
-
-        sleep(0.1)  # this delay prevents the merge of header and payload
-        # it is necessary to separate between the two
+            return 0
 
-        recv_size = self.receive_file(fh, self.size)  # send the payload
+        file_size = self.size
+        recv_size = self.receive_file(fh, file_size)  # receive the payload
         fh.close()
-        print(f'Received file of size: {recv_size} bytes')
-        try:
-            if recv_size != os.stat(filename).st_size:
-                raise RuntimeError
-        except RuntimeError:
-            print('Warning: Mismatch. The received file size does not equal to size on server')
         self.sock.shutdown(socket.SHUT_WR)  # notify to server that client has finished sending
         self.close()  # close connection
+        print(f'Received file of size: {recv_size} bytes')
+        if recv_size != file_size:
+            print('Warning: Mismatch. The received file size does not equal to size on server')
+            return 0
+        if self.payload is None:
+            print('Warning: The checksum of the file was not received')
+        elif verify_checksums and self.payload != self.checksum:
+            print(f'Warning: Mismatch. Received checksum {self.checksum:08x} != checksum on server {self.payload:08x}')
+            return 0
+        return report_throughput(filename, recv_size, perf_counter() - start)
+
+    def get_file_versions(self, filename: str) -> list:
+        """
+        get the kept versions of a file, newest first. a version can be passed to get_file as as_of
+        :param filename: the file on the server
+        :return: list of (version, size, crc32c) tuples
+        """
+        print(f"Request to get versions of file: {filename}")
+        msg_header = self.header(GET_FILE_VERSIONS, name_len=len(filename), filename=filename)
+        versions = []
+
+        self.connect(self._server_host, self._server_port)  # connect to server
+        self.sock.sendall(msg_header)  # send header
+        self.recv_response()  # get response
+        if self.status != return_codes['GET_FILE_VERSIONS_SUCCESS']:
+            print(f'Received error status {translate(self.status)}')
+            self.close()
+            return versions
+
+        try:
+            data = self.recv_all()
+        except socket.error as exc:
+            print(f'Socket connection is broken, {exc} , terminating client')
+            data = b''
+        finally:
+            self.close()
+
+        for line in data.decode().splitlines():
+            version, size, crc = line.split()
+            versions.append((int(version), int(size), int(crc, 16)))
+            print(line)
+        return versions
+
+    def backup_files(self, filenames: list, workers: int = transfer_workers) -> dict:
+        """
+        backup many files at the same time, one connection per file
+        :param filenames: the file paths to backup
+        :param workers: number of concurrent transfers
+        :return: dictionary of filename -> throughput in MB/s (0 if the backup failed)
+        """
+        with ThreadPoolExecutor(max_workers=workers) as pool:
+            rates = pool.map(lambda name: MySocket(self.userid).backup_file(name), filenames)
+            return dict(zip(filenames, rates))
+
+    def get_files(self, files: dict, workers: int = transfer_workers) -> dict:
+        """
+        retrieve many files at the same time, one connection per file
+        :param files: dictionary of filename on server -> destination name
+        :param workers: number of concurrent transfers
+        :return: dictionary of filename -> throughput in MB/s (0 if the file was not received)
+        """
+        with ThreadPoolExecutor(max_workers=workers) as pool:
+            rates = pool.map(lambda item: MySocket(self.userid).get_file(*item), files.items())
+            return dict(zip(files.keys(), rates))
 
     def erase_file(self, filename: str):
         """
@@ -316,6 +476,34 @@ class MySocket:
         self.sock.shutdown(socket.SHUT_WR)  # notify to server that client has finished sending
         self.close()  # close connection
 
+    def erase_files(self, filenames=None, prefix: str = ''):
+        """
+        erase many files in one request
+        :param filenames: list of filenames to erase in client's backup directory
+        :param prefix: when no list is given, erase all files that start with prefix.
+                       an empty prefix erases the whole backup directory
+        :return:
+        """
+        payload = '\n'.join(filenames).encode('utf-8') if filenames else b''
+        print(f"Request to erase files: {len(filenames) if filenames else 'prefix ' + repr(prefix)}")
+        if filenames:
+            prefix = ''
+        msg_header = self.header(ERASE_FILES, name_len=len(prefix), filename=prefix)
+
+        self.connect(self._server_host, self._server_port)  # connect to server
+        self.sock.sendall(msg_header + len(payload).to_bytes(4, 'little') + payload)  # send header + size + list
+        self.recv_response()
+        if self.status == return_codes['GENERAL_ERROR'] and filenames and self.name_len:
+            # the list had names outside the backup directory, nothing was erased
+            print(f"Server rejected {self.size} unsafe filenames, "
+                  f"the first one is {self.filename.decode('utf-8', errors='replace')!r}")
+        elif self.status != return_codes['BACKUP_FILE_OR_ERASE_FILE_SUCCESS']:
+            print(f'Received error status {translate(self.status)}')
+        else:
+            print(f'Erased {self.size} files')
+        self.sock.shutdown(socket.SHUT_WR)  # notify to server that client has finished sending
+        self.close()  # close connection
+
     def get_backup_list(self):
         """
         get list of all backed up files request
@@ -333,16 +521,70 @@ class MySocket:
             self.close()
             return
 
-        sleep(0.1)
         print(f'Receiving backup directory list, name={self.filename}, size={self.size}:')
-        line = b"_"
-        count = 0  # line count
+        try:
+            print(self.recv_all().decode())
+
+        except socket.error as exc:
+            print(f'Socket connection is broken, {exc} , terminating client')
+        finally:
+            self.sock.shutdown(socket.SHUT_WR)
+            self.close()
 
+    def get_server_stats(self) -> dict:
+        """
+        get the server's metrics (cache hit rate etc.)
+        :return: dictionary of metric name -> value
+        """
+        print("Request to get server stats")
+        msg_header = self.header(GET_SERVER_STATS)
+        stats = {}
+
+        self.connect(self._server_host, self._server_port)  # connect to server
+        self.sock.sendall(msg_header)  # send header
+        self.recv_response()  # get response
+        if self.status != return_codes['GET_SERVER_STATS_SUCCESS']:
+            print(f'Received error status {translate(self.status)}')
+            self.sock.shutdown(socket.SHUT_WR)
+            self.close()
+            return stats
+
+        data = b''
+        try:
+            data = self.recv_all()
+        except socket.error as exc:
+            print(f'Socket connection is broken, {exc} , terminating client')
+        finally:
+            self.sock.shutdown(socket.SHUT_WR)
+            self.close()
+
+        for line in data.decode().splitlines():
+            name, _, value = line.partition(' ')
+            stats[name] = float(value) if '.' in value else int(value)
+            print(line)
+        return stats
+
+    def verify_backup(self):
+        """
+        ask the server to check all the backed up files against their checksums
+        and print the report
+        :return:
+        """
+        print("Request to verify backup")
+        msg_header = self.header(VERIFY_BACKUP)
+
+        self.connect(self._server_host, self._server_port)  # connect to server
+        self.sock.sendall(msg_header)  # send header
+        self.recv_response()  # get response
+        if self.status not in (return_codes['VERIFY_BACKUP_SUCCESS'], return_codes['CHECKSUM_MISMATCH']):
+            print(f'Received error status {translate(self.status)}')
+            self.sock.shutdown(socket.SHUT_WR)
+            self.close()
+            return
+
+        print(f'Receiving verify report, name={self.filename}, size={self.size}:')
         try:
-            while line and (count <= self.size):
-                line = self.sock.recv(buffer_size)
-                count += 1
-                print(line.decode())
+            print(self.recv_all().decode(), end='')
 
         except socket.error as exc:
             print(f'Socket connection is broken, {exc} , terminating client')
@@ -351,18 +593,25 @@ class MySocket:
             self.close()
 
 
+def report_throughput(filename: str, size: int, seconds: float) -> float:
+    """
+    prints the throughput of one file transfer
+    :return: throughput in MB/s
+    """
+    rate = size / (1024 * 1024) / max(seconds, 1e-9)
+    print(f'{filename}: {size} bytes in {seconds:.3f} s, {rate:.1f} MB/s')
+    return rate
+
+
 def main():
     # get list of file on server's client directory
     client = MySocket(1234)
     client.get_backup_list()
 
-    # backup the first file
+    # backup all the files in backup.info, a few at a time
     client = MySocket(1234)
-    client.backup_file(client.backup_list[0])
-
-    # backup the second file
-    client = MySocket(1234)
-    client.backup_file(client.backup_list[1])
+    for name, rate in client.backup_files(client.backup_list).items():
+        print(f'Backup of {name}: ' + (f'{rate:.1f} MB/s' if rate else 'failed'))
 
     # get list of file on server's client directory
     client = MySocket(1234)
@@ -372,6 +621,10 @@ def main():
     client = MySocket(1234)
     client.get_file(client.backup_list[0], 'tmp')
 
+    # check the backed up files against their checksums
+    client = MySocket(1234)
+    client.verify_backup()
+
     # erase first file from backup directory on server
     client = MySocket(1234)
     client.erase_file(client.backup_list[0])
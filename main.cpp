@@ -1,16 +1,55 @@
 #include <cstdlib>
+#include <cstring>
+#include <stdexcept>
 #include <math.h>
 #include <iostream>
 #include <fstream>
 #include <filesystem>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <future>
+#include <functional>
+#include <shared_mutex>
+#include <ctime>
+#include <chrono>
+#include <memory>
+#include <map>
+#include <set>
+#include <unordered_map>
 #include <utility>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include <boost/random/random_device.hpp>
 #include <boost/random/uniform_int_distribution.hpp>
 #include "server.h"
 
+#if defined(__linux__)
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CRC32C_X64
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
 
 
 using boost::asio::ip::tcp;
@@ -19,6 +58,10 @@ using boost::asio::ip::tcp;
 /*-----------------------------------------------------------------------------------------------------------------*/
 /* Global variables */
 std::list<uint32_t> _clients; // will hold the ID's of all the clients that were connected
+Config _config; // runtime configuration, filled from the command line
+StorageBackend* _storage = nullptr; // where the backed up files are kept
+Catalog* _catalog = nullptr; // what is stored for every client
+FileCache* _cache = nullptr; // contents of recently restored files
 
 
 /*-----------------------------------------------------------------------------------------------------------------*/
@@ -26,19 +69,40 @@ std::list<uint32_t> _clients; // will hold the ID's of all the clients that were
 void printBuffer(uint8_t* buf, uint32_t length);
 bool findId(std::list<uint32_t > list, uint32_t id);
 void clear_buffer(uint8_t* buf, uint32_t length);
-void server(boost::asio::io_context& io_context, unsigned short port);
-void session(tcp::socket sock);
+void server(unsigned short port);
+void waitForShutdown(TieredStorage* storage);
+void blockShutdownSignals(bool block);
+void acceptConnections(unsigned shard, unsigned short port);
+void pinThread(unsigned cpu);
+void unpinThread();
+void session(std::shared_ptr<boost::asio::io_context> io, tcp::socket sock);
+bool opHasSize(uint8_t op, uint8_t version);
 bool mkdir(uint32_t userID);
+std::string clientDir(uint32_t userID);
+bool isShardDir(const boost::filesystem::path& dir);
+void migrateClients(const std::string& root);
+std::vector<uint32_t> findClients(const std::string& root);
+std::string joinPath(std::string dir, std::string name);
+bool isSafeFilename(const std::string& filename);
+bool parseArgs(int argc, char* argv[]);
 std::string generateRandomAlphaNum(const int len);
 std::string createDirListFile(std::string path, std::vector<std::string> dirList);
 std::vector<std::string> getDirList(std::string path);
 std::vector<uint8_t> buildResponse(Response* response, uint16_t retCode=0, uint16_t nameLen=0, std::string filename="", uint32_t size=0);
 uint16_t validateRequestValues(Request* request);
-uint16_t processRequest(tcp::socket& sock, Request* request, Response* response);
-uint16_t backupFile(tcp::socket& sock, Request* request);
-uint16_t retrieveFileFromBackup(tcp::socket& sock, Request* request, Response* response);
-uint16_t eraseFile(std::string path);
-uint16_t sendDirListFile(tcp::socket& sock, Request* request, Response* response, std::string fileName, std::vector<std::string> dirList);
+uint16_t processRequest(Connection& conn, Request* request, Response* response);
+uint16_t backupFile(Connection& conn, Request* request, uint32_t* checksum);
+uint16_t retrieveFileFromBackup(Connection& conn, Request* request, Response* response);
+uint16_t eraseFile(uint32_t userID, std::string filename);
+uint16_t eraseFiles(Connection& conn, Request* request, uint32_t* count, std::string* rejected);
+bool readPayload(Connection& conn, uint32_t size, std::string& payload);
+std::vector<std::string> serverStats();
+uint16_t sendDirListFile(Connection& conn, Request* request, Response* response, std::string fileName, std::vector<std::string> dirList, uint16_t retCode=GET_BACKUP_LIST_SUCCESS);
+uint16_t verifyBackup(uint32_t userID, std::vector<std::string> dirList, std::vector<std::string>& report);
+uint32_t crc32c(uint32_t crc, const uint8_t* data, size_t length);
+bool writeChecksumFile(std::string path, uint32_t crc);
+bool readChecksumFile(std::string path, uint32_t* crc);
+bool syncFile(const std::string& path);
 /*-----------------------------------------------------------------------------------------------------------------*/
 
 
@@ -50,15 +114,21 @@ uint16_t sendDirListFile(tcp::socket& sock, Request* request, Response* response
 /*
 * Receive and process client's request
 */
-void session(tcp::socket sock)
+void session(std::shared_ptr<boost::asio::io_context> io, tcp::socket sock)
 {
     boost::system::error_code error;
     
     bool RequestRead = false;
     uint8_t data[MAX_LENGTH] = {0};
     uint32_t offset = 0;
-    size_t length;
+    size_t length = 0;
+    size_t headerLength = HEADER_SIZE;
     uint16_t status = 0;
+    Connection conn(*io, std::move(sock));
+
+    // the session was started by a pinned acceptor. it and its workers may use every CPU
+    if (_config.acceptors > 1)
+        unpinThread();
 
 
     // create a sturct to hold client's Request
@@ -70,8 +140,22 @@ void session(tcp::socket sock)
 
     try
     {
-        /* first of all read the Request + size, once */
-        length = sock.read_some(boost::asio::buffer(data), error);
+        /* read the Request + size. the header has to arrive within the header timeout,
+           bytes of the payload that arrive with it are handed back to the connection */
+        conn.setDeadline(_config.headerTimeout, _config.headerTimeout, true);
+        while (length < headerLength)
+        {
+            length += conn.readSome(boost::asio::buffer(data + length, MAX_LENGTH - length), error);
+            if (error)
+                throw boost::system::system_error(error);
+
+            if (length >= HEADER_SIZE && headerLength == HEADER_SIZE) {
+                uint16_t nameLen = (data[7] << 8) + data[6];
+                if (nameLen > MAX_FILENAME_LENGTH)
+                    throw std::runtime_error("Filename too long");
+                headerLength = HEADER_SIZE + nameLen + (opHasSize(data[5], data[4]) ? 4 : 0);
+            }
+        }
 
 
         /* insert the appropriate bytes to their corresponding field in the Request
@@ -98,11 +182,17 @@ void session(tcp::socket sock)
             request->filename += data[offset];
 
         
-        /* read the file size into the size field in payload */
-        request->size = data[offset + 3];
-        request->size = (request->size << 8) + data[offset + 2];
-        request->size = (request->size << 8) + data[offset + 1];
-        request->size = (request->size << 8) + data[offset + 0];
+        /* read the file size into the size field in payload. GET_FILE of version 2 sends the
+           as-of time there, older clients always get the latest file. the other requests
+           without a payload may leave it out */
+        if (length >= offset + 4 && (request->op != GET_FILE || opHasSize(request->op, request->version))) {
+            request->size = data[offset + 3];
+            request->size = (request->size << 8) + data[offset + 2];
+            request->size = (request->size << 8) + data[offset + 1];
+            request->size = (request->size << 8) + data[offset + 0];
+            offset += 4;
+        }
+        conn.unread(data + offset, length - std::min<size_t>(length, offset));
 
 
         /* if the client is new, than add him to the clients list */
@@ -113,12 +203,14 @@ void session(tcp::socket sock)
         if (!validateRequestValues(request)) {
             throw boost::system::system_error(error);
         }
+        response->version = request->version; // answer in the format of the client's version
         std::cout << "User ID: " << std::to_string(request->userid) << std::endl;
         
 
         
         /* address the request and act appropriately */
-        status = processRequest(sock, request, response);
+        conn.setDeadline(_config.idleTimeout, _config.transferTimeout);
+        status = processRequest(conn, request, response);
 
 
 
@@ -141,26 +233,47 @@ cleanup:
 
 
 
+/*
+* true for the operations whose header always ends with the size field in the given version
+*/
+bool opHasSize(uint8_t op, uint8_t version)
+{
+    return op == BACKUP_FILE || op == BACKUP_FILE_CHECKED || op == ERASE_FILES || (op == GET_FILE && version >= 2);
+}
+
+
+
 /*
 * insures that some of the recieved values of the Request are valid according to protocol
 */
 uint16_t validateRequestValues(Request * request)
 {
     // if version is incorrect
-    if (request->version != VERSION_CLIENT)
+    if (request->version < VERSION_CLIENT_MIN || request->version > VERSION_CLIENT)
         return false;
     
     // if operation is illegal. there is additional check later in processRequest
     if (request->op != BACKUP_FILE &&
+        request->op != BACKUP_FILE_CHECKED &&
         request->op != GET_FILE &&
         request->op != ERASE_FILE &&
-        request->op != GET_BACKUP_LIST)
+        request->op != GET_BACKUP_LIST &&
+        request->op != VERIFY_BACKUP &&
+        request->op != ERASE_FILES &&
+        request->op != GET_SERVER_STATS &&
+        request->op != GET_FILE_VERSIONS)
         return false;
 
     // if the filename contains '\0's instead of characters 
     if (request->nameLen != request->filename.size())
         return false;
 
+    // operations on a single file need a name that stays inside the client's directory
+    if ((request->op == BACKUP_FILE || request->op == BACKUP_FILE_CHECKED || request->op == GET_FILE || request->op == ERASE_FILE ||
+         request->op == GET_FILE_VERSIONS) &&
+        !isSafeFilename(request->filename))
+        return false;
+
     // all the above checks have passed
     return true;
 }
@@ -170,14 +283,17 @@ uint16_t validateRequestValues(Request * request)
 * address the operation in the received request, and perform the appropriate
 * sequence of tasks.
 */
-uint16_t processRequest(tcp::socket& sock, Request * request, Response * response)
+uint16_t processRequest(Connection& conn, Request * request, Response * response)
 {
     uint16_t retCode = 0;
-    std::string path = SERVER_BACKUP_PARENT_DIR;
+    uint32_t checksum = 0;
+    uint32_t count = 0;
+    std::string rejected; // first unsafe name of an erase list
     std::string dirListfileName = "";
     std::string seq = "";
     std::vector<uint8_t> resArr;
     std::vector<std::string> dirList;
+    std::vector<std::string> report;
 
     try
     {
@@ -186,13 +302,14 @@ uint16_t processRequest(tcp::socket& sock, Request * request, Response * respons
             //--------------------------------------------------------------------------------------------
             //--------------------------------------------------------------------------------------------
         case BACKUP_FILE:
+        case BACKUP_FILE_CHECKED:
             std::cout << "Saving file for backup: " << request->filename << std::endl;
 
             // make sure that the given file size is not larger than uint32
             if (request->size >= pow(2, 32)){
                 std::cout << "File size to large (larger than 2^32 bytes)" << std::endl;
                 resArr = buildResponse(response, GENERAL_ERROR);
-                boost::asio::write(sock, boost::asio::buffer(resArr));
+                conn.write(boost::asio::buffer(resArr));
                 return GENERAL_ERROR;
             }
 
@@ -200,14 +317,19 @@ uint16_t processRequest(tcp::socket& sock, Request * request, Response * respons
             if (!mkdir(request->userid)) {
                 std::cout << "Error opening client's directory" << std::endl;
                 resArr = buildResponse(response, GENERAL_ERROR);
-                boost::asio::write(sock, boost::asio::buffer(resArr));
+                conn.write(boost::asio::buffer(resArr));
                 return GENERAL_ERROR;
             }
 
-            retCode = backupFile(sock, request);
+            retCode = backupFile(conn, request, &checksum);
             
-            resArr = buildResponse(response, retCode, request->nameLen, response->filename);
-            boost::asio::write(sock, boost::asio::buffer(resArr));
+            // on success, the size field holds the CRC32C of the stored bytes so the client can compare
+            // it to its own. version 1 clients get no size field
+            if (retCode == BACKUP_FILE_SUCCESS && request->version >= 2)
+                resArr = buildResponse(response, retCode, request->nameLen, request->filename, checksum);
+            else
+                resArr = buildResponse(response, retCode, request->nameLen, response->filename);
+            conn.write(boost::asio::buffer(resArr));
             break;
 
 
@@ -218,39 +340,20 @@ uint16_t processRequest(tcp::socket& sock, Request * request, Response * respons
         case GET_FILE:
             std::cout << "Retreaving file from backup: " << request->filename << std::endl;
 
-            path += std::to_string(request->userid);
-
-            // check if client's directory actually exists
-            if (!boost::filesystem::exists(path) && !boost::filesystem::is_directory(path)) {
-                std::cout << "Error opening client's directory" << std::endl;
+            // check if the client has any backed up files
+            if (!_catalog->hasUser(request->userid)) {
+                std::cout << "Client has no backed up files" << std::endl;
                 resArr = buildResponse(response, NO_FILES_FOR_CLIENT);
-                boost::asio::write(sock, boost::asio::buffer(resArr));
+                conn.write(boost::asio::buffer(resArr));
                 return NO_FILES_FOR_CLIENT;
             }
 
-            path += ("\\" + request->filename);
-
-            // check if the required file exists
-            if (!boost::filesystem::exists(path)) {
-                std::cout << "Client's file does not exist" << std::endl;
-                resArr = buildResponse(response, FILE_NOT_FOUND, request->nameLen, response->filename);
-                boost::asio::write(sock, boost::asio::buffer(resArr));
-                return FILE_NOT_FOUND;
-            }
-            
-            // check if the file is not empty
-            if (boost::filesystem::file_size(path) == 0) {
-                std::cout << "Client's file size is 0" << std::endl;
-                resArr = buildResponse(response, FILE_NOT_FOUND, request->nameLen, response->filename);
-                boost::asio::write(sock, boost::asio::buffer(resArr));
-                return FILE_NOT_FOUND;
-            }
-
-            retCode = retrieveFileFromBackup(sock, request, response);
+            // a missing or empty file is reported as FILE_NOT_FOUND
+            retCode = retrieveFileFromBackup(conn, request, response);
             
             if (retCode != GET_FILE_SUCCESS) {
                 resArr = buildResponse(response, retCode, request->nameLen, response->filename);
-                boost::asio::write(sock, boost::asio::buffer(resArr));
+                conn.write(boost::asio::buffer(resArr));
             }
             break;
         
@@ -261,29 +364,42 @@ uint16_t processRequest(tcp::socket& sock, Request * request, Response * respons
         case ERASE_FILE:
             std::cout << "Erasing file from backup: " << request->filename << std::endl;
             
-            path += std::to_string(request->userid);
-
-            // check if client's directory actually exists
-            if (!boost::filesystem::exists(path) && !boost::filesystem::is_directory(path)) {
-                std::cout << "Error opening client's directory" << std::endl;
+            // check if the client has any backed up files
+            if (!_catalog->hasUser(request->userid)) {
+                std::cout << "Client has no backed up files" << std::endl;
                 resArr = buildResponse(response, NO_FILES_FOR_CLIENT);
-                boost::asio::write(sock, boost::asio::buffer(resArr));
+                conn.write(boost::asio::buffer(resArr));
                 return NO_FILES_FOR_CLIENT;
             }
 
-            path += ("\\" + request->filename);
+            // a missing file is reported as FILE_NOT_FOUND
+            retCode = eraseFile(request->userid, request->filename);
+            resArr = buildResponse(response, retCode, request->nameLen, response->filename);
+            conn.write(boost::asio::buffer(resArr));
+            break;
+
 
-            // check if the required file exists
-            if (!boost::filesystem::exists(path)) {
-                std::cout << "Client's file does not exist" << std::endl;
-                resArr = buildResponse(response, FILE_NOT_FOUND, request->nameLen, response->filename);
-                boost::asio::write(sock, boost::asio::buffer(resArr));
-                return FILE_NOT_FOUND;
+            //--------------------------------------------------------------------------------------------
+            //--------------------------------------------------------------------------------------------
+        case ERASE_FILES:
+            std::cout << "Erasing files from backup, prefix: " << request->filename << std::endl;
+
+            // check if the client has any backed up files
+            if (!_catalog->hasUser(request->userid)) {
+                std::cout << "Client has no backed up files" << std::endl;
+                resArr = buildResponse(response, NO_FILES_FOR_CLIENT);
+                conn.write(boost::asio::buffer(resArr));
+                return NO_FILES_FOR_CLIENT;
             }
 
-            retCode = eraseFile(path);
-            resArr = buildResponse(response, retCode, request->nameLen, response->filename);
-            boost::asio::write(sock, boost::asio::buffer(resArr));
+            // the size field of the response holds the number of erased files. when the list is
+            // rejected, it holds the number of unsafe names and the filename field the first one
+            retCode = eraseFiles(conn, request, &count, &rejected);
+            if (!rejected.empty())
+                resArr = buildResponse(response, retCode, (uint16_t)rejected.size(), rejected, count);
+            else
+                resArr = buildResponse(response, retCode, request->nameLen, request->filename, count);
+            conn.write(boost::asio::buffer(resArr));
             break;
 
         
@@ -292,23 +408,21 @@ uint16_t processRequest(tcp::socket& sock, Request * request, Response * respons
         case GET_BACKUP_LIST:
             std::cout << "Returning files list for client: " << request->userid << std::endl;
 
-            path += std::to_string(request->userid);
-
-            // check if client's directory actually exists
-            if (!boost::filesystem::exists(path) && !boost::filesystem::is_directory(path)) {
-                std::cout << "Error opening client's directory" << std::endl;
+            // check if the client has any backed up files
+            if (!_catalog->hasUser(request->userid)) {
+                std::cout << "Client has no backed up files" << std::endl;
                 resArr = buildResponse(response, NO_FILES_FOR_CLIENT);
-                boost::asio::write(sock, boost::asio::buffer(resArr));
+                conn.write(boost::asio::buffer(resArr));
                 return NO_FILES_FOR_CLIENT;
             }
 
             // get the list of files in client's directory
-            dirList = getDirList(path);
+            dirList = _storage->list(request->userid);
 
             if (dirList.empty()) {
                 std::cout << "Client's directory is empty" << std::endl;
                 resArr = buildResponse(response, NO_FILES_FOR_CLIENT);
-                boost::asio::write(sock, boost::asio::buffer(resArr));
+                conn.write(boost::asio::buffer(resArr));
                 return NO_FILES_FOR_CLIENT;
             }
             
@@ -317,17 +431,103 @@ uint16_t processRequest(tcp::socket& sock, Request * request, Response * respons
             
             
             // send the dir list
-            retCode = sendDirListFile(sock, request, response, seq, dirList);
+            retCode = sendDirListFile(conn, request, response, seq, dirList);
 
             if (retCode != GET_BACKUP_LIST_SUCCESS) {
                 std::cout << "Error occured while sending dir list file" << std::endl;
                 resArr = buildResponse(response, GENERAL_ERROR);
-                boost::asio::write(sock, boost::asio::buffer(resArr));
+                conn.write(boost::asio::buffer(resArr));
             }
 
             break;
 
-        
+
+
+            //--------------------------------------------------------------------------------------------
+            //--------------------------------------------------------------------------------------------
+        case VERIFY_BACKUP:
+            std::cout << "Verifying checksums of files for client: " << request->userid << std::endl;
+
+            // check if the client has any backed up files
+            if (!_catalog->hasUser(request->userid)) {
+                std::cout << "Client has no backed up files" << std::endl;
+                resArr = buildResponse(response, NO_FILES_FOR_CLIENT);
+                conn.write(boost::asio::buffer(resArr));
+                return NO_FILES_FOR_CLIENT;
+            }
+
+            dirList = _storage->list(request->userid);
+
+            if (dirList.empty()) {
+                std::cout << "Client's directory is empty" << std::endl;
+                resArr = buildResponse(response, NO_FILES_FOR_CLIENT);
+                conn.write(boost::asio::buffer(resArr));
+                return NO_FILES_FOR_CLIENT;
+            }
+
+            // scrub all the files, then send the per-file report the same way as the dir list
+            retCode = verifyBackup(request->userid, dirList, report);
+            seq = generateRandomAlphaNum(32) + ".txt";
+
+            if (sendDirListFile(conn, request, response, seq, report, retCode) != retCode) {
+                std::cout << "Error occured while sending verify report" << std::endl;
+                resArr = buildResponse(response, GENERAL_ERROR);
+                conn.write(boost::asio::buffer(resArr));
+                retCode = GENERAL_ERROR;
+            }
+            break;
+
+
+            //--------------------------------------------------------------------------------------------
+            //--------------------------------------------------------------------------------------------
+        case GET_SERVER_STATS:
+            std::cout << "Returning server stats" << std::endl;
+
+            seq = generateRandomAlphaNum(32) + ".txt";
+            retCode = sendDirListFile(conn, request, response, seq, serverStats(), GET_SERVER_STATS_SUCCESS);
+
+            if (retCode != GET_SERVER_STATS_SUCCESS) {
+                resArr = buildResponse(response, GENERAL_ERROR);
+                conn.write(boost::asio::buffer(resArr));
+            }
+            break;
+
+
+            //--------------------------------------------------------------------------------------------
+            //--------------------------------------------------------------------------------------------
+        case GET_FILE_VERSIONS:
+            std::cout << "Returning versions of file: " << request->filename << std::endl;
+
+            // check if the client has any backed up files
+            if (!_catalog->hasUser(request->userid)) {
+                std::cout << "Client has no backed up files" << std::endl;
+                resArr = buildResponse(response, NO_FILES_FOR_CLIENT);
+                conn.write(boost::asio::buffer(resArr));
+                return NO_FILES_FOR_CLIENT;
+            }
+
+            // the live file first, then the kept versions. a version can be passed to GET_FILE
+            for (const FileVersion& version : _storage->versions(request->userid, request->filename)) {
+                std::ostringstream line;
+                line << version.version << " " << version.size << " " << std::hex << std::setw(8) << std::setfill('0') << version.crc;
+                dirList.push_back(line.str());
+            }
+
+            if (dirList.empty()) {
+                resArr = buildResponse(response, FILE_NOT_FOUND, request->nameLen, request->filename);
+                conn.write(boost::asio::buffer(resArr));
+                return FILE_NOT_FOUND;
+            }
+
+            seq = generateRandomAlphaNum(32) + ".txt";
+            retCode = sendDirListFile(conn, request, response, seq, dirList, GET_FILE_VERSIONS_SUCCESS);
+
+            if (retCode != GET_FILE_VERSIONS_SUCCESS) {
+                resArr = buildResponse(response, GENERAL_ERROR);
+                conn.write(boost::asio::buffer(resArr));
+            }
+            break;
+
 
         default:
             std::string err = std::to_string(request->op);
@@ -347,29 +547,30 @@ uint16_t processRequest(tcp::socket& sock, Request * request, Response * respons
 
 /*
 * perfrom a backup operation. receive a file from the client and save it
-* in the client's directory
+* in the client's backup storage.
+* the CRC32C of the received bytes is computed in the same pass, saved with the
+* backed up file and returned through checksum.
 */
-uint16_t backupFile(tcp::socket& sock, Request * request)
+uint16_t backupFile(Connection& conn, Request * request, uint32_t* checksum)
 {
     boost::system::error_code error;
     uint32_t size = 0;
     uint32_t byteCount = 0;
+    uint32_t crc = 0;
     uint8_t chunk[MAX_LENGTH] = { 0 };
-    std::string path = SERVER_BACKUP_PARENT_DIR;
+    std::unique_ptr<StorageWriter> writer;
     
     
     
-    std::cout << "Attempting to create file at path: " << std::to_string(request->userid) + "\\" << request->filename << std::endl;
-    path += (std::to_string(request->userid) + "\\" + request->filename);
+    std::cout << "Attempting to create file: " << request->filename << std::endl;
 
     
-    // attempt to create the file to backup (append mode)
-    std::ofstream file;
+    // attempt to create the file to backup
     try
     {
-        file.open(path, std::ios::out | std::ios::binary);
-        if (!file)
-            throw std::exception("File not open");
+        writer = _storage->create(request->userid, request->filename, request->size);
+        if (!writer)
+            throw std::runtime_error("File not open");
     }
     catch (const std::exception& e)
     {
@@ -380,9 +581,11 @@ uint16_t backupFile(tcp::socket& sock, Request * request)
     // attempt to receive the incoming packets and write their data to the created file
     try
     {
+        conn.startTransfer();
         while (byteCount < request->size)
         {    
-            size = sock.read_some(boost::asio::buffer(chunk), error);
+            // the client's checksum may follow the payload, it is not part of the file
+            size = conn.readSome(boost::asio::buffer(chunk, std::min<uint32_t>(MAX_LENGTH, request->size - byteCount)), error);
             byteCount += size;
 
 
@@ -395,7 +598,9 @@ uint16_t backupFile(tcp::socket& sock, Request * request)
            
 
             // write/append the chunk to the created file
-            file.write((char*) &chunk, size);
+            if (!writer->write(chunk, size))
+                throw std::runtime_error("Error writing file");
+            crc = crc32c(crc, chunk, size);
 
             // clear the data buffer before the next read
             clear_buffer(chunk, MAX_LENGTH);
@@ -408,43 +613,111 @@ uint16_t backupFile(tcp::socket& sock, Request * request)
         
         std::cout << "Read " << byteCount << " bytes" << std::endl;
 
+        // BACKUP_FILE_CHECKED: the payload is followed by the CRC32C that the client computed
+        if (request->op == BACKUP_FILE_CHECKED) {
+            uint8_t trailer[CHECKSUM_SIZE] = { 0 };
+            size_t length = 0;
+
+            while (length < CHECKSUM_SIZE) {
+                size = conn.readSome(boost::asio::buffer(trailer + length, CHECKSUM_SIZE - length), error);
+                if (error || size == 0)
+                    throw std::runtime_error("Checksum of the client not received");
+                length += size;
+            }
+
+            uint32_t sent = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((uint32_t)trailer[3] << 24);
+            if (sent != crc) {
+                // the writer discards the upload, the previous backup stays as it was
+                std::cout << "Mismatch. Checksum of the client " << std::hex << std::setw(8) << std::setfill('0') << sent
+                          << " != checksum of the received bytes " << std::setw(8) << crc << std::dec << std::endl;
+                return CHECKSUM_MISMATCH;
+            }
+        }
     }
     catch (std::exception& e)
     {
+        // the writer discards the partial file, the previous backup stays as it was
         std::cerr << "Exception in thread, readFileAndBackup: " << e.what() << "\n";
-        file.close();
         return GENERAL_ERROR;
     }
     
-    file.close();
+    if (!writer->commit(crc)) {
+        std::cout << "Error saving file: " << request->filename << std::endl;
+        return GENERAL_ERROR;
+    }
+    std::cout << "CRC32C " << std::hex << std::setw(8) << std::setfill('0') << crc << std::dec << std::endl;
+
+    *checksum = crc;
     return BACKUP_FILE_SUCCESS;
 }
 
 
 /*
 * Send back the file that the client has specified.
+* files that fit in the cache are served from memory; concurrent restores of the same
+* file share one read from the disk.
 */
-uint16_t retrieveFileFromBackup(tcp::socket& sock, Request* request, Response* response)
+uint16_t retrieveFileFromBackup(Connection& conn, Request* request, Response* response)
 {
     boost::system::error_code error;
-    std::string path = SERVER_BACKUP_PARENT_DIR;
     uint32_t size = 0;
     uint32_t byteCount = 0;
-    uint8_t chunk[MAX_LENGTH] = { 0 };
+    uint32_t fileSize = 0;
+    uint32_t crc = 0;
+    uint32_t storedCrc = 0;
+    std::vector<uint8_t> chunk(FILE_IO_CHUNK);
     std::vector<uint8_t> resArr;
+    std::unique_ptr<StorageReader> reader;
+    CatalogEntry entry;
     
 
     std::cout << "Retrieving file: " << request->filename << std::endl;
-    path += (std::to_string(request->userid) + "\\" + request->filename);
 
 
     // attempt to open the file
-    std::ifstream file;
     try
     {
-        file.open(path, std::ios::out | std::ios::binary);
-        if (!file)
-            throw std::exception("File not open");
+        if (!_catalog->lookup(request->userid, request->filename, &entry))
+            throw std::runtime_error("File not found");
+
+        // a non zero size field asks for the file as it was at that time (seconds since the epoch)
+        if (request->size != 0 && entry.mtime > (int64_t)request->size) {
+            std::cout << "Retrieving version as of " << request->size << std::endl;
+            reader = _storage->openVersion(request->userid, request->filename, request->size);
+            if (!reader)
+                throw std::runtime_error("No version that old");
+        }
+        else if (_cache->cacheable(entry.size)) {
+            // the key changes with every new backup of the file, so stale contents are never served
+            std::string key = std::to_string(request->userid) + "/" + request->filename + "/" +
+                              std::to_string(entry.mtime) + "/" + std::to_string(entry.size) + "/" + std::to_string(entry.crc);
+
+            FileCache::Data data = _cache->get(key, [&](std::vector<uint8_t>& buf) {
+                std::unique_ptr<StorageReader> disk = _storage->open(request->userid, request->filename);
+                size_t length = 0;
+                uint32_t crc = 0;
+
+                // a backup that replaced the file after the lookup is not cached under the old key
+                if (!disk || disk->size() != entry.size || !disk->checksum(&crc) || crc != entry.crc)
+                    return false;
+                buf.resize(disk->size());
+                while (length < buf.size()) {
+                    size_t n = disk->read(buf.data() + length, buf.size() - length);
+                    if (n == 0)
+                        break;
+                    length += n;
+                }
+                return length == buf.size();
+            });
+
+            if (data)
+                reader.reset(new BufferReader(data, entry.crc));
+        }
+
+        if (!reader)
+            reader = _storage->open(request->userid, request->filename);
+        if (!reader)
+            throw std::runtime_error("File not open");
     }
     catch (const std::exception& e)
     {
@@ -454,67 +727,166 @@ uint16_t retrieveFileFromBackup(tcp::socket& sock, Request* request, Response* r
 
     
     
-    /* first, send the header of the response. then send the payload of the file */
+    fileSize = reader->size();
+    bool hasStoredCrc = reader->checksum(&storedCrc);
+
+    // check if the file is not empty
+    if (fileSize == 0) {
+        std::cout << "Client's file size is 0" << std::endl;
+        return FILE_NOT_FOUND;
+    }
+
+    /* first, send the header of the response. then send the payload of the file.
+       the payload is followed by the CRC32C of the file */
     resArr = buildResponse(response, GET_FILE_SUCCESS, 
                             request->nameLen, 
                             request->filename, 
-                            boost::filesystem::file_size(path));
+                            fileSize);
     
     try
     {
         // send the response header
-        boost::asio::write(sock, boost::asio::buffer(resArr));
+        conn.write(boost::asio::buffer(resArr));
 
         // send the file payload
-        while (byteCount < boost::filesystem::file_size(path))
+        conn.startTransfer();
+        while (byteCount < fileSize)
         {
-            if (file.eof()) // check if file pointer reached the end of the file
+            size = reader->read(chunk.data(), chunk.size()); // try to read FILE_IO_CHUNK amount of bytes
+            if (size == 0) // check if the reader reached the end of the file
                 break;
-            
-            file.read((char*)&chunk, MAX_LENGTH);  // try to read MAX_LANGTH amount of bytes
-            size = file.gcount(); // get amount of bytes that were read successfuly
             byteCount += size;
+            crc = crc32c(crc, chunk.data(), size);
 
             // send the chunk to client
-            boost::asio::write(sock, boost::asio::buffer(chunk));
+            conn.write(boost::asio::buffer(chunk.data(), size));
             
             if (error)
                 throw boost::system::system_error(error); // Some other error.
-
-            // clear the data buffer before the next read
-            clear_buffer(chunk, MAX_LENGTH);
         }
 
         std::cout << "Sent " << byteCount << " bytes" << std::endl;
 
+        // send the checksum that was recorded at backup time, so the client also detects
+        // corruption that happened on the server's disk. version 1 clients expect no trailer
+        if (hasStoredCrc && storedCrc != crc)
+            std::cout << "Warning: checksum mismatch for " << request->filename << std::endl;
+        if (!hasStoredCrc)
+            storedCrc = crc;
+
+        if (request->version >= 2) {
+            uint8_t trailer[CHECKSUM_SIZE] = { (uint8_t)storedCrc, (uint8_t)(storedCrc >> 8), (uint8_t)(storedCrc >> 16), (uint8_t)(storedCrc >> 24) };
+            conn.write(boost::asio::buffer(trailer));
+        }
+
     }
     catch (std::exception& e)
     {
         std::cerr << "Exception in thread, readFileAndBackup: " << e.what() << "\n";
-        file.close();
         return GENERAL_ERROR;
     }
 
-    file.close();
     return GET_FILE_SUCCESS;
 }
 
 
 /*
-* Erase client's specified file from his dirctory in the server
+* Erase client's specified file from his backup storage in the server
 */
-uint16_t eraseFile(std::string path)
+uint16_t eraseFile(uint32_t userID, std::string filename)
 {
     try
     {
-        boost::filesystem::remove(path);
+        return _storage->erase(userID, filename);
     }
     catch (const std::exception& e)
     {
         std::cerr << "Exception in thread, eraseFile: " << e.what() << "\n";
         return GENERAL_ERROR;
     }
-    return ERASE_FILE_SUCCESS;
+}
+
+
+/*
+* Erase many files of the client in one request. the payload (request->size bytes) is a list
+* of filenames separated by '\n'. without a payload, all the files that start with
+* request->filename are erased, which is the whole backup when the filename is empty.
+* the files are only dropped from the catalog here, the disk space is reclaimed in the background.
+* a list with a name that does not stay inside the client's directory erases nothing: rejected
+* gets the first such name and count the number of them.
+*/
+uint16_t eraseFiles(Connection& conn, Request* request, uint32_t* count, std::string* rejected)
+{
+    std::vector<std::string> names;
+    std::string payload;
+
+    *count = 0;
+    rejected->clear();
+
+    if (request->size > 0) {
+        if (request->size > ERASE_LIST_MAX_SIZE || !readPayload(conn, request->size, payload)) {
+            std::cout << "Error receiving list of files to erase" << std::endl;
+            return GENERAL_ERROR;
+        }
+
+        std::istringstream lines(payload);
+        std::string line;
+        while (std::getline(lines, line)) {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (line.empty())
+                continue;
+            if (isSafeFilename(line)) {
+                names.push_back(line);
+                continue;
+            }
+            std::cout << "Rejecting unsafe filename in erase list: " << line << std::endl;
+            if (rejected->empty())
+                *rejected = line.substr(0, MAX_FILENAME_LENGTH); // it has to fit in the filename field
+            (*count)++;
+        }
+
+        if (*count > 0) {
+            std::cout << "Erase list has " << *count << " unsafe filenames, nothing is erased" << std::endl;
+            return GENERAL_ERROR;
+        }
+    }
+    else {
+        for (const std::string& name : _storage->list(request->userid)) {
+            if (name.compare(0, request->filename.size(), request->filename) == 0)
+                names.push_back(name);
+        }
+    }
+
+    for (const std::string& name : names) {
+        if (eraseFile(request->userid, name) == ERASE_FILE_SUCCESS)
+            (*count)++;
+    }
+
+    std::cout << "Erased " << *count << " of " << names.size() << " files" << std::endl;
+    return *count ? ERASE_FILE_SUCCESS : FILE_NOT_FOUND;
+}
+
+
+/*
+* read exactly size bytes of request payload from the client
+*/
+bool readPayload(Connection& conn, uint32_t size, std::string& payload)
+{
+    boost::system::error_code error;
+    uint8_t chunk[MAX_LENGTH] = { 0 };
+
+    payload.clear();
+    payload.reserve(size);
+    conn.startTransfer();
+    while (payload.size() < size)
+    {
+        size_t length = conn.readSome(boost::asio::buffer(chunk, std::min<size_t>(MAX_LENGTH, size - payload.size())), error);
+        if (error || length == 0)
+            return false;
+        payload.append((const char*)chunk, length);
+    }
+    return true;
 }
 
 
@@ -532,6 +904,11 @@ std::vector<std::string> getDirList(std::string path)
 
         
         for (const auto& entry : boost::filesystem::directory_iterator(path)) {
+            // skip checksum sidecar files and the server's own metadata
+            if (entry.path().extension() == CHECKSUM_FILE_EXT ||
+                entry.path().filename().string()[0] == '.' ||
+                !boost::filesystem::is_regular_file(entry.status()))
+                continue;
             std::cout << entry.path().filename().string() << std::endl;
             listOfFiles.push_back(entry.path().filename().string());
         }
@@ -551,7 +928,7 @@ std::vector<std::string> getDirList(std::string path)
 /*
 * Send back a list with the client's current files in his directory.
 */
-uint16_t sendDirListFile(tcp::socket& sock, Request* request, Response* response, std::string fileName, std::vector<std::string> dirList)
+uint16_t sendDirListFile(Connection& conn, Request* request, Response* response, std::string fileName, std::vector<std::string> dirList, uint16_t retCode)
 {
     boost::system::error_code error;
     std::vector<uint8_t> resArr;
@@ -562,14 +939,14 @@ uint16_t sendDirListFile(tcp::socket& sock, Request* request, Response* response
 
     /* first, send the header of the response. then send the payload of the file */
     resArr = buildResponse(response,
-                            GET_BACKUP_LIST_SUCCESS,
+                            retCode,
                             36, // 32 + .txt
                             fileName,                                                
                             dirList.size());
     try
     {
         // send the response header
-        boost::asio::write(sock, boost::asio::buffer(resArr));
+        conn.write(boost::asio::buffer(resArr));
 
         
         // send vector elements
@@ -577,7 +954,7 @@ uint16_t sendDirListFile(tcp::socket& sock, Request* request, Response* response
             
             // add a 'new line' seperator between lines inside the payload, so that
             // the client will parse it and print out seperate lines
-            boost::asio::write(sock, boost::asio::buffer(*line + '\n'));
+            conn.write(boost::asio::buffer(*line + '\n'));
         
             byteCount += (*line).size();
             if (error)
@@ -591,76 +968,2261 @@ uint16_t sendDirListFile(tcp::socket& sock, Request* request, Response* response
         std::cerr << "Exception in thread, readFileAndBackup: " << e.what() << "\n";
         return GENERAL_ERROR;
     }
-    return GET_BACKUP_LIST_SUCCESS;
+    return retCode;
 }
 
 
+/*
+* Scrub the client's backup: recompute the CRC32C of every file and compare it to
+* the checksum that was saved at backup time. the files are split between several
+* worker threads. report gets one "<filename> <result>" line per file.
+*/
+uint16_t verifyBackup(uint32_t userID, std::vector<std::string> dirList, std::vector<std::string>& report)
+{
+    std::atomic<size_t> next(0);
+    std::atomic<bool> mismatch(false);
+    unsigned int workers = std::thread::hardware_concurrency();
+
+    workers = std::max(1u, std::min(workers, (unsigned int)dirList.size()));
+    report.assign(dirList.size(), "");
+
+    auto scrub = [&]() {
+        std::vector<uint8_t> chunk(FILE_IO_CHUNK);
+
+        for (size_t i = next++; i < dirList.size(); i = next++) {
+            std::unique_ptr<StorageReader> reader;
+            uint32_t actual = 0;
+            uint32_t stored = 0;
+            uint64_t byteCount = 0;
+            size_t size = 0;
+
+            try
+            {
+                reader = _storage->open(userID, dirList[i]);
+                while (reader && (size = reader->read(chunk.data(), chunk.size())) > 0) {
+                    actual = crc32c(actual, chunk.data(), size);
+                    byteCount += size;
+                }
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "Exception in thread, verifyBackup: " << e.what() << "\n";
+                reader.reset();
+            }
 
-std::string generateRandomAlphaNum(const int len)
+            if (!reader || byteCount != reader->size()) {
+                report[i] = dirList[i] + " UNREADABLE";
+                mismatch = true;
+            }
+            else if (!reader->checksum(&stored)) {
+                report[i] = dirList[i] + " NO_CHECKSUM";
+            }
+            else if (stored != actual) {
+                report[i] = dirList[i] + " CORRUPT";
+                mismatch = true;
+            }
+            else {
+                report[i] = dirList[i] + " OK";
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned int i = 1; i < workers; i++)
+        pool.emplace_back(scrub);
+    scrub();
+    for (auto& t : pool)
+        t.join();
+
+    return mismatch ? CHECKSUM_MISMATCH : VERIFY_BACKUP_SUCCESS;
+}
+
+
+
+/*-----------------------------------------------------------------------------------------------------------------*/
+/* Storage backends */
+
+
+/*
+* little endian helpers for the on-disk formats
+*/
+static void putLittleEndian(std::vector<uint8_t>& buf, uint64_t value, int bytes)
 {
-    std::string s = "";
-    std::string chars =
-        "0123456789"
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-        "abcdefghijklmnopqrstuvwxyz";
+    for (int i = 0; i < bytes; i++)
+        buf.push_back((uint8_t)(value >> (8 * i)));
+}
 
-    s.reserve(len);
-    boost::random::random_device rng;
-    boost::random::uniform_int_distribution<> index_dist(0, chars.size() - 1);
-    
-    for (int i = 0; i < len; i++) {
-        s += chars[index_dist(rng)];
-    }
-    return s;
+static uint64_t getLittleEndian(const uint8_t* buf, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+        value = (value << 8) + buf[i];
+    return value;
+}
+
+
+BufferReader::BufferReader(std::shared_ptr<const std::vector<uint8_t>> data, uint32_t crc)
+    : _data(data), _crc(crc)
+{
+}
+
+uint32_t BufferReader::size()
+{
+    return (uint32_t)_data->size();
+}
+
+bool BufferReader::checksum(uint32_t* crc)
+{
+    *crc = _crc;
+    return true;
+}
+
+size_t BufferReader::read(uint8_t* data, size_t length)
+{
+    length = std::min(length, _data->size() - _offset);
+    memcpy(data, _data->data() + _offset, length);
+    _offset += length;
+    return length;
 }
 
 
 /*
-* creating a text file that saves the dir list.
-* (not used in the project due to some clarifications in the mmn14 forum).
+* writes a new backup to a temporary file that replaces the old backup on commit.
+* the incoming data is compared with the old backup as it arrives. where the filesystem
+* supports reflinks the temporary file starts as a clone of the old backup and only the chunks
+* that changed are written, so both versions share the unchanged extents.
 */
-std::string createDirListFile(std::string path, std::vector<std::string> dirList)
+class FileWriter : public StorageWriter
 {
-    // create 32 random alpha-numeric character sequence
-    std::string seq = generateRandomAlphaNum(32) + ".txt";
-    
-    // attempt to open the file
-    std::ofstream file;
-    try
+public:
+    FileWriter(std::string path, std::string tempPath) : _path(path), _tempPath(tempPath)
     {
-        file.open(path + seq);
-        if (!file)
-            throw std::exception("File not open");
+        boost::system::error_code error;
+
+        _file = fopen(_tempPath.c_str(), "wb");
+        if (!_file)
+            return;
+        setvbuf(_file, nullptr, _IOFBF, FILE_IO_CHUNK);
+
+        _base = fopen(_path.c_str(), "rb");
+        if (!_base)
+            return;
+        setvbuf(_base, nullptr, _IOFBF, FILE_IO_CHUNK);
+        _baseSize = boost::filesystem::file_size(_path, error);
+
+#if defined(__linux__) && defined(FICLONE)
+        _cloned = ioctl(fileno(_file), FICLONE, fileno(_base)) == 0;
+#endif
     }
-    catch (const std::exception& e)
+
+    ~FileWriter()
     {
-        std::cerr << "Exception in thread, createDirListFile: " << e.what() << "\n";
-        return "";
+        boost::system::error_code error;
+        if (_base)
+            fclose(_base);
+        if (_file)
+            fclose(_file);
+        if (!_committed) {
+            boost::filesystem::remove(_tempPath, error);
+            boost::filesystem::remove(_tempPath + CHECKSUM_FILE_EXT, error);
+        }
     }
 
+    bool isOpen()
+    {
+        return _file != nullptr;
+    }
 
-
-    std::cout << "Creating list of files for client: " << seq << std::endl;
-    try
+    bool write(const uint8_t* data, size_t length) override
     {
-        for (std::size_t i = 0; i < dirList.size(); i++) {
-            file << dirList[i] << std::endl;
-        }       
+        bool same = false;
+
+        if (_base) {
+            _compare.resize(length);
+            same = fread(_compare.data(), 1, length, _base) == length && memcmp(_compare.data(), data, length) == 0;
+            // without a clone there is nothing to share
+            if (!same && !_cloned) {
+                fclose(_base);
+                _base = nullptr;
+            }
+        }
+        _written += length;
+
+        // the cloned file already holds these bytes. skip over them so the extent stays shared
+        if (same && _cloned) {
+            _skipped += length;
+            return true;
+        }
+#if defined(__linux__)
+        if (_skipped > 0 && fseeko(_file, (off_t)_skipped, SEEK_CUR) != 0)
+            return false;
+#endif
+        _skipped = 0;
+        return fwrite(data, 1, length, _file) == length;
     }
-    catch (const std::exception& e)
+
+    bool commit(uint32_t crc) override
     {
-        std::cerr << "Exception in thread, createDirListFile: " << e.what() << "\n";
-        return "";
+        boost::system::error_code error;
+
+        if (_base) {
+            fclose(_base);
+            _base = nullptr;
+        }
+
+#if defined(__linux__)
+        // a clone of a longer old backup keeps its tail until it is cut off
+        if (_cloned && _written < _baseSize && (fflush(_file) != 0 || ftruncate(fileno(_file), (off_t)_written) != 0))
+            return false;
+#endif
+        int closed = fclose(_file);
+        _file = nullptr;
+        if (closed != 0 || !writeChecksumFile(_tempPath, crc))
+            return false;
+
+        // the old checksum goes first. if the server stops before the new one is in place, the
+        // file has no checksum, which the catalog rebuild computes again, instead of a wrong one
+        boost::filesystem::remove(_path + CHECKSUM_FILE_EXT, error);
+        boost::filesystem::rename(_tempPath, _path, error);
+        if (error) {
+            std::cerr << "Error renaming " << _tempPath << ": " << error.message() << "\n";
+            return false;
+        }
+        _committed = true;
+
+        // the new data is in place and goes into the catalog, it is only stored without a checksum file
+        boost::filesystem::rename(_tempPath + CHECKSUM_FILE_EXT, _path + CHECKSUM_FILE_EXT, error);
+        if (error)
+            std::cerr << "Error renaming the checksum of " << _tempPath << ": " << error.message() << "\n";
+        return true;
     }
 
-    file.close();
-    return seq;
-}
+private:
+    std::string _path;
+    std::string _tempPath;
+    FILE* _file = nullptr;
+    FILE* _base = nullptr; // the old backup, while it is compared with the new data
+    uint64_t _baseSize = 0;
+    uint64_t _written = 0;
+    uint64_t _skipped = 0; // unchanged bytes of a clone that were not written yet
+    std::vector<uint8_t> _compare;
+    bool _cloned = false;
+    bool _committed = false;
+};
 
 
 /*
-* modifies the server's response according to the given parameters
-* and reflects that in the contents of a given response array: resArr.
+* reads a backed up file straight from the client's directory.
+* the kernel is told that the file is read sequentially, and is asked to read
+* ahead of the reader one READAHEAD_WINDOW at a time.
+*/
+class FileReader : public StorageReader
+{
+public:
+    FileReader(std::string path) : _path(path)
+    {
+#if defined(_MSC_VER)
+        _file = fopen(path.c_str(), "rbS"); // S: FILE_FLAG_SEQUENTIAL_SCAN
+#else
+        _file = fopen(path.c_str(), "rb");
+#endif
+        if (!_file)
+            return;
+        _size = (uint32_t)boost::filesystem::file_size(path);
+        _hasChecksum = readChecksumFile(path, &_checksum); // read together with the data it belongs to
+        setvbuf(_file, nullptr, _IOFBF, FILE_IO_CHUNK);
+
+#if defined(__linux__)
+        posix_fadvise(fileno(_file), 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fileno(_file), 0, READAHEAD_WINDOW, POSIX_FADV_WILLNEED);
+#endif
+        _advised = READAHEAD_WINDOW;
+    }
+
+    ~FileReader()
+    {
+        if (_file)
+            fclose(_file);
+    }
+
+    bool isOpen()
+    {
+        return _file != nullptr;
+    }
+
+    uint32_t size() override
+    {
+        return _size;
+    }
+
+    bool checksum(uint32_t* crc) override
+    {
+        if (_hasChecksum)
+            *crc = _checksum;
+        return _hasChecksum;
+    }
+
+    size_t read(uint8_t* data, size_t length) override
+    {
+        if (!_file)
+            return 0;
+        length = fread(data, 1, length, _file);
+        _offset += length;
+
+        // keep the next window in flight while the current one is being sent
+        if (_offset + READAHEAD_WINDOW / 2 >= _advised && _advised < _size) {
+#if defined(__linux__)
+            posix_fadvise(fileno(_file), _advised, READAHEAD_WINDOW, POSIX_FADV_WILLNEED);
+#endif
+            _advised += READAHEAD_WINDOW;
+        }
+        return length;
+    }
+
+private:
+    std::string _path;
+    FILE* _file = nullptr;
+    uint32_t _size = 0;
+    uint32_t _checksum = 0;
+    bool _hasChecksum = false;
+    uint64_t _offset = 0;
+    uint64_t _advised = 0; // the kernel was asked to read ahead up to this offset
+};
+
+
+std::unique_ptr<StorageWriter> FileStorage::create(uint32_t userID, const std::string& filename, uint32_t)
+{
+    std::string dir = clientDir(userID);
+    std::unique_ptr<FileWriter> writer(new FileWriter(joinPath(dir, filename),
+                                                      joinPath(dir, ".partial-" + generateRandomAlphaNum(16))));
+    if (!writer->isOpen())
+        return nullptr;
+    return writer;
+}
+
+std::unique_ptr<StorageReader> FileStorage::open(uint32_t userID, const std::string& filename)
+{
+    std::string path = joinPath(clientDir(userID), filename);
+
+    if (!boost::filesystem::is_regular_file(path))
+        return nullptr;
+
+    std::unique_ptr<FileReader> reader(new FileReader(path));
+    if (!reader->isOpen())
+        return nullptr;
+    return reader;
+}
+
+uint16_t FileStorage::erase(uint32_t userID, const std::string& filename)
+{
+    std::string path = joinPath(clientDir(userID), filename);
+
+    if (!boost::filesystem::remove(path))
+        return FILE_NOT_FOUND;
+    boost::filesystem::remove(path + CHECKSUM_FILE_EXT);
+    return ERASE_FILE_SUCCESS;
+}
+
+std::vector<std::string> FileStorage::list(uint32_t userID)
+{
+    return getDirList(clientDir(userID));
+}
+
+
+/*
+* buffers a small file in memory and appends it to the client's active segment on commit
+*/
+class SegmentWriter : public StorageWriter
+{
+public:
+    SegmentWriter(SegmentStorage* storage, uint32_t userID, const std::string& filename, uint32_t size)
+        : _storage(storage), _userID(userID), _filename(filename), _size(size)
+    {
+        _data.reserve(size);
+    }
+
+    bool write(const uint8_t* data, size_t length) override
+    {
+        if (_data.size() + length > _size)
+            return false;
+        _data.insert(_data.end(), data, data + length);
+        return true;
+    }
+
+    bool commit(uint32_t crc) override
+    {
+        return _storage->put(_userID, _filename, _data, crc);
+    }
+
+private:
+    SegmentStorage* _storage;
+    uint32_t _userID;
+    std::string _filename;
+    uint32_t _size;
+    std::vector<uint8_t> _data;
+};
+
+
+static std::string segmentPath(const std::string& dir, uint32_t segment)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%08u.seg", (unsigned int)segment);
+    return joinPath(dir, name);
+}
+
+
+/*
+* returns the state of the client's segments. the caller locks it and calls load()
+*/
+SegmentClient* SegmentStorage::client(uint32_t userID)
+{
+    SegmentClient* c;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        std::unique_ptr<SegmentClient>& slot = _segmentClients[userID];
+        if (!slot)
+            slot.reset(new SegmentClient);
+        c = slot.get();
+    }
+    return c;
+}
+
+
+/*
+* read the client's index log and rebuild the in-memory index.
+* a torn record at the end of the log (crash while appending) is cut off.
+*/
+bool SegmentStorage::load(uint32_t userID, SegmentClient* c)
+{
+    if (c->loaded)
+        return true;
+
+    c->dir = joinPath(clientDir(userID), SEGMENT_DIR);
+    std::string indexPath = joinPath(c->dir, "index");
+    boost::system::error_code error;
+
+    if (boost::filesystem::exists(indexPath, error)) {
+        std::ifstream file(indexPath, std::ios::in | std::ios::binary);
+        std::vector<uint8_t> log((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        size_t offset = 0;
+
+        while (offset + 3 <= log.size()) {
+            uint16_t nameLen = (uint16_t)getLittleEndian(&log[offset + 1], 2);
+            size_t recordSize = 3 + nameLen + 20;
+            if (offset + recordSize + 4 > log.size())
+                break;
+
+            const uint8_t* record = &log[offset];
+            if (crc32c(0, record, recordSize) != (uint32_t)getLittleEndian(record + recordSize, 4))
+                break;
+
+            uint8_t type = record[0];
+            std::string filename((const char*)record + 3, nameLen);
+            SegmentEntry entry;
+            entry.segment = (uint32_t)getLittleEndian(record + 3 + nameLen, 4);
+            entry.offset = getLittleEndian(record + 3 + nameLen + 4, 8);
+            entry.length = (uint32_t)getLittleEndian(record + 3 + nameLen + 12, 4);
+            entry.crc = (uint32_t)getLittleEndian(record + 3 + nameLen + 16, 4);
+
+            if (type == SEGMENT_RECORD_PUT) {
+                c->totalBytes[entry.segment] += entry.length;
+                setEntry(c, filename, entry);
+            }
+            else if (c->index.count(filename)) {
+                const SegmentEntry& old = c->index[filename];
+                c->liveBytes[old.segment] -= old.length;
+                c->index.erase(filename);
+            }
+
+            c->records++;
+            offset += recordSize + 4;
+        }
+
+        if (offset != log.size()) {
+            std::cout << "Cutting torn segment index record at offset " << offset << " in " << indexPath << std::endl;
+            boost::filesystem::resize_file(indexPath, offset, error);
+        }
+    }
+
+    // new files are appended to the last segment. a segment that no record points to was
+    // left by a compaction or an append that did not finish, it is deleted
+    std::vector<boost::filesystem::path> unreferenced;
+    if (boost::filesystem::is_directory(c->dir, error)) {
+        for (const auto& entry : boost::filesystem::directory_iterator(c->dir)) {
+            if (entry.path().extension() != ".seg")
+                continue;
+            uint32_t segment = (uint32_t)std::strtoul(entry.path().stem().string().c_str(), nullptr, 10);
+            if (!c->totalBytes.count(segment)) {
+                unreferenced.push_back(entry.path());
+                continue;
+            }
+            if (segment >= c->active) {
+                c->active = segment;
+                c->activeSize = boost::filesystem::file_size(entry.path());
+            }
+        }
+    }
+    for (const boost::filesystem::path& path : unreferenced) {
+        std::cout << "Removing unreferenced segment " << path.string() << std::endl;
+        boost::filesystem::remove(path, error);
+    }
+
+    c->loaded = true;
+    return true;
+}
+
+
+/*
+* append the data to the active segment, starting a new segment if it is full.
+* entry gets the location of the data.
+*/
+bool SegmentStorage::appendData(SegmentClient* c, const uint8_t* data, uint32_t length, uint32_t crc, SegmentEntry* entry)
+{
+    if (c->activeSize > 0 && c->activeSize + length > SEGMENT_MAX_SIZE) {
+        c->segmentOut.close();
+        c->active++;
+        c->activeSize = 0;
+    }
+
+    if (!c->segmentOut.is_open()) {
+        boost::filesystem::create_directories(c->dir);
+        c->segmentOut.open(segmentPath(c->dir, c->active), std::ios::out | std::ios::binary | std::ios::app);
+        if (!c->segmentOut)
+            return false;
+    }
+
+    entry->segment = c->active;
+    entry->offset = c->activeSize;
+    entry->length = length;
+    entry->crc = crc;
+
+    c->segmentOut.write((const char*)data, length);
+    c->segmentOut.flush();
+    c->activeSize += length;
+    if (!c->segmentOut) {
+        c->segmentOut.close();
+        return false;
+    }
+
+    c->totalBytes[c->active] += length;
+    return true;
+}
+
+
+/*
+* append a record to the client's index log.
+* record layout: type(1) name_len(2) filename segment(4) offset(8) length(4) crc(4) record_crc(4)
+*/
+bool SegmentStorage::appendRecord(SegmentClient* c, uint8_t type, const std::string& filename, const SegmentEntry& entry)
+{
+    std::vector<uint8_t> record;
+
+    record.push_back(type);
+    putLittleEndian(record, filename.size(), 2);
+    record.insert(record.end(), filename.begin(), filename.end());
+    putLittleEndian(record, entry.segment, 4);
+    putLittleEndian(record, entry.offset, 8);
+    putLittleEndian(record, entry.length, 4);
+    putLittleEndian(record, entry.crc, 4);
+    putLittleEndian(record, crc32c(0, record.data(), record.size()), 4);
+
+    if (!c->indexOut.is_open()) {
+        boost::filesystem::create_directories(c->dir);
+        c->indexOut.open(joinPath(c->dir, "index"), std::ios::out | std::ios::binary | std::ios::app);
+    }
+
+    c->indexOut.write((const char*)record.data(), record.size());
+    c->indexOut.flush();
+    if (!c->indexOut) {
+        c->indexOut.close();
+        return false;
+    }
+    c->records++;
+    return true;
+}
+
+
+/*
+* point filename at entry and update the live byte counts of the segments
+*/
+void SegmentStorage::setEntry(SegmentClient* c, const std::string& filename, const SegmentEntry& entry)
+{
+    auto old = c->index.find(filename);
+    if (old != c->index.end())
+        c->liveBytes[old->second.segment] -= old->second.length;
+
+    c->index[filename] = entry;
+    c->liveBytes[entry.segment] += entry.length;
+}
+
+
+bool SegmentStorage::readEntry(SegmentClient* c, const SegmentEntry& entry, std::vector<uint8_t>& data)
+{
+    if (!c->segmentIn.is_open() || c->segmentInId != entry.segment) {
+        c->segmentIn.close();
+        c->segmentIn.open(segmentPath(c->dir, entry.segment), std::ios::in | std::ios::binary);
+        c->segmentInId = entry.segment;
+    }
+
+    c->segmentIn.clear();
+    c->segmentIn.seekg(entry.offset);
+    data.resize(entry.length);
+    c->segmentIn.read((char*)data.data(), entry.length);
+    return c->segmentIn.gcount() == (std::streamsize)entry.length;
+}
+
+
+bool SegmentStorage::put(uint32_t userID, const std::string& filename, const std::vector<uint8_t>& data, uint32_t crc)
+{
+    SegmentClient* c = client(userID);
+    std::lock_guard<std::mutex> guard(c->lock);
+    SegmentEntry entry;
+
+    try
+    {
+        if (!load(userID, c) ||
+            !appendData(c, data.data(), (uint32_t)data.size(), crc, &entry) ||
+            !appendRecord(c, SEGMENT_RECORD_PUT, filename, entry))
+            return false;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Exception in thread, SegmentStorage::put: " << e.what() << "\n";
+        return false;
+    }
+
+    setEntry(c, filename, entry);
+    return true;
+}
+
+
+std::unique_ptr<StorageWriter> SegmentStorage::create(uint32_t userID, const std::string& filename, uint32_t size)
+{
+    return std::unique_ptr<StorageWriter>(new SegmentWriter(this, userID, filename, size));
+}
+
+std::unique_ptr<StorageReader> SegmentStorage::open(uint32_t userID, const std::string& filename)
+{
+    SegmentClient* c = client(userID);
+    std::lock_guard<std::mutex> guard(c->lock);
+
+    load(userID, c);
+    auto it = c->index.find(filename);
+    if (it == c->index.end())
+        return nullptr;
+
+    // packed files are small, copy them out so the segment can be compacted under the reader
+    std::shared_ptr<std::vector<uint8_t>> data(new std::vector<uint8_t>);
+    if (!readEntry(c, it->second, *data)) {
+        std::cerr << "Error reading " << filename << " from segment " << it->second.segment << "\n";
+        return nullptr;
+    }
+    return std::unique_ptr<StorageReader>(new BufferReader(data, it->second.crc));
+}
+
+uint16_t SegmentStorage::erase(uint32_t userID, const std::string& filename)
+{
+    SegmentClient* c = client(userID);
+    std::lock_guard<std::mutex> guard(c->lock);
+
+    load(userID, c);
+    auto it = c->index.find(filename);
+    if (it == c->index.end())
+        return FILE_NOT_FOUND;
+
+    if (!appendRecord(c, SEGMENT_RECORD_TOMBSTONE, filename, SegmentEntry()))
+        return GENERAL_ERROR;
+
+    c->liveBytes[it->second.segment] -= it->second.length;
+    c->index.erase(it);
+    return ERASE_FILE_SUCCESS;
+}
+
+/*
+* forget the in-memory state of the client, after its directory was deleted
+*/
+void SegmentStorage::drop(uint32_t userID)
+{
+    SegmentClient* c = client(userID);
+    std::lock_guard<std::mutex> guard(c->lock);
+
+    c->segmentOut.close();
+    c->indexOut.close();
+    c->segmentIn.close();
+    c->index.clear();
+    c->totalBytes.clear();
+    c->liveBytes.clear();
+    c->active = 1;
+    c->activeSize = 0;
+    c->records = 0;
+    c->loaded = false;
+}
+
+std::map<std::string, SegmentEntry> SegmentStorage::entries(uint32_t userID)
+{
+    SegmentClient* c = client(userID);
+    std::lock_guard<std::mutex> guard(c->lock);
+
+    load(userID, c);
+    return c->index;
+}
+
+std::vector<std::string> SegmentStorage::list(uint32_t userID)
+{
+    SegmentClient* c = client(userID);
+    std::lock_guard<std::mutex> guard(c->lock);
+    std::vector<std::string> listOfFiles;
+
+    load(userID, c);
+    for (const auto& entry : c->index)
+        listOfFiles.push_back(entry.first);
+    return listOfFiles;
+}
+
+
+/*
+* write a new index log with one record per live file and replace the old log with it
+*/
+bool SegmentStorage::rewriteIndex(SegmentClient* c)
+{
+    std::string indexPath = joinPath(c->dir, "index");
+    std::string tempPath = indexPath + ".tmp";
+    boost::system::error_code error;
+
+    c->indexOut.close();
+    c->indexOut.open(tempPath, std::ios::out | std::ios::binary | std::ios::trunc);
+    c->records = 0;
+
+    for (const auto& entry : c->index) {
+        if (!appendRecord(c, SEGMENT_RECORD_PUT, entry.first, entry.second)) {
+            c->indexOut.close();
+            boost::filesystem::remove(tempPath, error);
+            return false;
+        }
+    }
+
+    c->indexOut.close();
+    if (!syncFile(tempPath)) {
+        std::cerr << "Error syncing segment index " << tempPath << "\n";
+        boost::filesystem::remove(tempPath, error);
+        return false;
+    }
+    boost::filesystem::rename(tempPath, indexPath, error);
+    if (error) {
+        std::cerr << "Error replacing segment index " << indexPath << ": " << error.message() << "\n";
+        return false;
+    }
+    return syncFile(c->dir);
+}
+
+
+/*
+* move the live files out of sealed segments that are mostly dead, then delete those segments.
+* the index log is rewritten when most of its records are stale.
+*/
+void SegmentStorage::compact(SegmentClient* c)
+{
+    std::set<uint32_t> victims;
+    boost::system::error_code error;
+
+    if (!c->loaded)
+        return;
+
+    for (const auto& segment : c->totalBytes) {
+        if (segment.first != c->active &&
+            c->liveBytes[segment.first] * 100 < segment.second * COMPACT_LIVE_PERCENT)
+            victims.insert(segment.first);
+    }
+
+    if (victims.empty() && c->records <= 2 * c->index.size() + 1024)
+        return;
+
+    std::vector<uint8_t> data;
+    std::set<uint32_t> targets; // the segments the live files were moved to
+    for (auto& entry : c->index) {
+        if (!victims.count(entry.second.segment))
+            continue;
+
+        SegmentEntry moved;
+        if (!readEntry(c, entry.second, data) ||
+            !appendData(c, data.data(), (uint32_t)data.size(), entry.second.crc, &moved)) {
+            std::cerr << "Error compacting " << entry.first << " in " << c->dir << "\n";
+            return;
+        }
+        c->liveBytes[entry.second.segment] -= entry.second.length;
+        c->liveBytes[moved.segment] += moved.length;
+        targets.insert(moved.segment);
+        entry.second = moved;
+    }
+
+    // the moved data and the new index that points to it are on the disk before the victims
+    // are deleted, a crash in between leaves segments that the next load sweeps
+    for (uint32_t segment : targets) {
+        if (!syncFile(segmentPath(c->dir, segment))) {
+            std::cerr << "Error syncing segment " << segment << " in " << c->dir << "\n";
+            return;
+        }
+    }
+    if (!rewriteIndex(c))
+        return;
+
+    c->segmentIn.close();
+    for (uint32_t segment : victims) {
+        boost::filesystem::remove(segmentPath(c->dir, segment), error);
+        c->totalBytes.erase(segment);
+        c->liveBytes.erase(segment);
+    }
+
+    std::cout << "Compacted " << victims.size() << " segments in " << c->dir << std::endl;
+}
+
+
+void SegmentStorage::compactLoop()
+{
+    for (;;)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(COMPACT_INTERVAL));
+
+        std::vector<SegmentClient*> clients;
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            for (const auto& c : _segmentClients)
+                clients.push_back(c.second.get());
+        }
+
+        for (SegmentClient* c : clients) {
+            std::lock_guard<std::mutex> guard(c->lock);
+            try
+            {
+                compact(c);
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "Exception in thread, compactLoop: " << e.what() << "\n";
+            }
+        }
+    }
+}
+
+
+void SegmentStorage::startCompactor()
+{
+    std::thread(&SegmentStorage::compactLoop, this).detach();
+}
+
+
+/*
+* VersionStore: older versions of the backed up files
+*/
+std::string VersionStore::dir(uint32_t userID, const std::string& filename)
+{
+    return joinPath(joinPath(clientDir(userID), VERSIONS_DIR), filename);
+}
+
+
+/*
+* a version is named by its time, <time>.<sequence> for the later ones from the same second
+*/
+std::string VersionStore::path(uint32_t userID, const std::string& filename, const FileVersion& version)
+{
+    std::string name = std::to_string(version.version);
+    if (version.sequence > 0)
+        name += "." + std::to_string(version.sequence);
+    return joinPath(dir(userID, filename), name);
+}
+
+
+/*
+* copy the file that is described by entry aside, before a new backup replaces it.
+* the copy only becomes a version with keep(), once the new backup is committed.
+* returns the path of the copy, empty if there is none
+*/
+std::string VersionStore::stage(const CatalogEntry& entry, StorageBackend* from)
+{
+    boost::system::error_code error;
+    std::string path = joinPath(dir(entry.userID, entry.filename), VERSION_STAGED);
+
+    boost::filesystem::create_directories(dir(entry.userID, entry.filename), error);
+    boost::filesystem::remove(path, error); // left over from a commit that was cut short
+
+    // the file storage replaces files by a rename, so a hard link keeps the old data alive
+    if (entry.location == LOCATION_FILE) {
+        boost::filesystem::create_hard_link(joinPath(clientDir(entry.userID), entry.filename), path, error);
+        if (!error)
+            return path;
+    }
+
+    // packed files, and filesystems without hard links, get a copy
+    std::unique_ptr<StorageReader> reader = from->open(entry.userID, entry.filename);
+    std::vector<uint8_t> chunk(FILE_IO_CHUNK);
+    std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    size_t length = 0;
+
+    if (!reader || !file)
+        return "";
+    while ((length = reader->read(chunk.data(), chunk.size())) > 0)
+        file.write((const char*)chunk.data(), length);
+    file.close();
+    if (file.fail()) {
+        boost::filesystem::remove(path, error);
+        return "";
+    }
+    return path;
+}
+
+
+/*
+* turn the staged copy of the file that is described by entry into a version.
+* a version from the same second is kept next to the earlier ones
+*/
+bool VersionStore::keep(const CatalogEntry& entry, const std::string& staged)
+{
+    boost::system::error_code error;
+    FileVersion version;
+
+    version.version = entry.mtime;
+    while (boost::filesystem::exists(path(entry.userID, entry.filename, version), error))
+        version.sequence++;
+
+    // the checksum goes first, a version is only listed once its data is in place
+    std::string kept = path(entry.userID, entry.filename, version);
+    if (!writeChecksumFile(kept, entry.crc))
+        return false;
+    boost::filesystem::rename(staged, kept, error);
+    if (error) {
+        boost::filesystem::remove(kept + CHECKSUM_FILE_EXT, error);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+* drop a staged copy whose new backup was not committed
+*/
+void VersionStore::drop(const std::string& staged)
+{
+    boost::system::error_code error;
+    boost::filesystem::remove(staged, error);
+}
+
+
+/*
+* kept versions of a file, newest first
+*/
+std::vector<FileVersion> VersionStore::list(uint32_t userID, const std::string& filename)
+{
+    std::vector<FileVersion> versions;
+    boost::system::error_code error;
+    boost::filesystem::directory_iterator it(dir(userID, filename), error), end;
+
+    for (; !error && it != end; it.increment(error)) {
+        std::string name = it->path().filename().string();
+        size_t dot = name.find('.');
+        if (name.empty() || name.find_first_not_of("0123456789.") != std::string::npos ||
+            dot == 0 || (dot != std::string::npos && name.find('.', dot + 1) != std::string::npos))
+            continue;
+
+        FileVersion version;
+        version.version = std::strtoll(name.c_str(), nullptr, 10);
+        if (dot != std::string::npos)
+            version.sequence = (uint32_t)std::strtoul(name.c_str() + dot + 1, nullptr, 10);
+        version.size = boost::filesystem::file_size(it->path());
+        readChecksumFile(it->path().string(), &version.crc);
+        versions.push_back(version);
+    }
+
+    std::sort(versions.begin(), versions.end(), [](const FileVersion& a, const FileVersion& b) {
+        return a.version != b.version ? a.version > b.version : a.sequence > b.sequence;
+    });
+    return versions;
+}
+
+
+/*
+* the newest kept version that is not newer than asOf
+*/
+std::unique_ptr<StorageReader> VersionStore::open(uint32_t userID, const std::string& filename, int64_t asOf)
+{
+    for (const FileVersion& version : list(userID, filename)) {
+        if (version.version > asOf)
+            continue;
+
+        std::unique_ptr<FileReader> reader(new FileReader(path(userID, filename, version)));
+        if (!reader->isOpen())
+            return nullptr;
+        return reader;
+    }
+    return nullptr;
+}
+
+
+/*
+* apply the retention policy to the kept versions of a file. current is the version of
+* the live file (0 if there is none); it counts towards keepLast and is never deleted.
+* returns the number of deleted versions
+*/
+size_t VersionStore::prune(uint32_t userID, const std::string& filename, int64_t current, uint32_t keepLast, uint32_t keepDaily)
+{
+    int64_t now = (int64_t)std::time(nullptr);
+    std::set<int64_t> days; // days that already have a kept version
+    uint32_t index = 0;
+    size_t removed = 0;
+    boost::system::error_code error;
+
+    if (current) {
+        days.insert(current / 86400);
+        index++;
+    }
+
+    for (const FileVersion& version : list(userID, filename)) {
+        int64_t day = version.version / 86400;
+        bool keep = index++ < keepLast;
+
+        // the newest version of each of the last keepDaily days
+        if (!keep && now - version.version < (int64_t)keepDaily * 86400 && days.count(day) == 0)
+            keep = true;
+
+        if (keep) {
+            days.insert(day);
+            continue;
+        }
+
+        std::string path = this->path(userID, filename, version);
+        boost::filesystem::remove(path + CHECKSUM_FILE_EXT, error);
+        if (boost::filesystem::remove(path, error))
+            removed++;
+    }
+
+    // the caller holds the commit lock, so a staged copy is left over from a crash
+    boost::filesystem::remove(joinPath(dir(userID, filename), VERSION_STAGED), error);
+
+    if (boost::filesystem::is_empty(dir(userID, filename), error) && !error)
+        boost::filesystem::remove(dir(userID, filename), error);
+    return removed;
+}
+
+
+void VersionStore::erase(uint32_t userID, const std::string& filename)
+{
+    boost::system::error_code error;
+    boost::filesystem::remove_all(dir(userID, filename), error);
+}
+
+
+/*
+* names of the client's files that have kept versions
+*/
+std::vector<std::string> VersionStore::files(uint32_t userID)
+{
+    std::vector<std::string> names;
+    boost::system::error_code error;
+    boost::filesystem::directory_iterator it(joinPath(clientDir(userID), VERSIONS_DIR), error), end;
+
+    for (; !error && it != end; it.increment(error))
+        names.push_back(it->path().filename().string());
+    return names;
+}
+
+
+
+/*
+* commits into one tier and then drops the copy of the same file from the other tier,
+* e.g. when a file that used to be small was backed up again with a larger size.
+*/
+class TieredWriter : public StorageWriter
+{
+public:
+    TieredWriter(std::unique_ptr<StorageWriter> writer, StorageBackend* other, TieredStorage* storage, Catalog* catalog, std::mutex& lock, uint32_t& writers, const CatalogEntry& entry)
+        : _writer(std::move(writer)), _other(other), _storage(storage), _catalog(catalog), _lock(lock), _writers(writers), _entry(entry)
+    {
+    }
+
+    ~TieredWriter()
+    {
+        // drop the partial file before the reclaimer may delete the client's directory
+        _writer.reset();
+        std::lock_guard<std::mutex> guard(_lock);
+        _writers--;
+    }
+
+    bool write(const uint8_t* data, size_t length) override
+    {
+        return _writer->write(data, length);
+    }
+
+    bool commit(uint32_t crc) override
+    {
+        // the reclaimer must not delete the file between the commit and the catalog update
+        std::lock_guard<std::mutex> guard(_lock);
+        CatalogEntry replaced;
+        bool replacing = _catalog->lookup(_entry.userID, _entry.filename, &replaced);
+
+        // a backup with the same size and checksum as the stored file is dropped, the stored
+        // file stays as it is and no version is kept for it
+        if (replacing && replaced.location == _entry.location && replaced.size == _entry.size && replaced.crc == crc) {
+            std::cout << "Unchanged, keeping the stored file " << _entry.filename << std::endl;
+            return true;
+        }
+
+        // the file that is replaced becomes an older version, but only once the new one is stored
+        std::string staged = replacing ? _storage->stageVersion(replaced) : "";
+
+        if (!_writer->commit(crc)) {
+            _storage->dropVersion(staged);
+            return false;
+        }
+
+        _entry.crc = crc;
+        _entry.mtime = (int64_t)std::time(nullptr);
+        if (!_catalog->put(_entry)) {
+            _storage->rollback(_entry, replacing ? &replaced : nullptr, staged);
+            return false;
+        }
+        _storage->cancelReclaim(_entry.userID, _entry.filename);
+        _storage->keepVersion(replaced, staged);
+
+        try
+        {
+            _other->erase(_entry.userID, _entry.filename);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Exception in thread, TieredWriter::commit: " << e.what() << "\n";
+        }
+        return true;
+    }
+
+private:
+    std::unique_ptr<StorageWriter> _writer;
+    StorageBackend* _other;
+    TieredStorage* _storage;
+    Catalog* _catalog;
+    std::mutex& _lock;
+    uint32_t& _writers;
+    CatalogEntry _entry;
+};
+
+
+TieredStorage::TieredStorage(uint32_t packedFileMax, Catalog* catalog, uint32_t reclaimRate, uint32_t keepLast, uint32_t keepDaily)
+    : _packedFileMax(packedFileMax), _catalog(catalog), _reclaimRate(reclaimRate), _keepLast(keepLast), _keepDaily(keepDaily)
+{
+}
+
+/*
+* start the background threads. they walk the catalog and the client directories, so
+* this is called once the catalog is open or rebuilt
+*/
+void TieredStorage::start()
+{
+    if (_packedFileMax > 0)
+        _segments.startCompactor();
+    std::thread(&TieredStorage::reclaimLoop, this).detach();
+    std::thread(&TieredStorage::pruneLoop, this).detach();
+}
+
+std::mutex& TieredStorage::commitLock(uint32_t userID)
+{
+    return _commitLocks[userID % 64];
+}
+
+StorageBackend* TieredStorage::tier(uint8_t location)
+{
+    return location == LOCATION_SEGMENT ? (StorageBackend*)&_segments : (StorageBackend*)&_files;
+}
+
+std::unique_ptr<StorageWriter> TieredStorage::create(uint32_t userID, const std::string& filename, uint32_t size)
+{
+    CatalogEntry entry;
+    entry.userID = userID;
+    entry.filename = filename;
+    entry.size = size;
+    entry.location = _packedFileMax > 0 && size <= _packedFileMax ? LOCATION_SEGMENT : LOCATION_FILE; // 0 disables packing
+
+    StorageBackend* other = tier(entry.location == LOCATION_SEGMENT ? LOCATION_FILE : LOCATION_SEGMENT);
+    std::unique_ptr<StorageWriter> writer;
+    uint32_t& writers = _writers[userID % 64];
+
+    // while the client has a writer in flight the reclaimer keeps the client's directory
+    {
+        std::lock_guard<std::mutex> guard(commitLock(userID));
+        writers++;
+    }
+    if (mkdir(userID))
+        writer = tier(entry.location)->create(userID, filename, size);
+    if (!writer) {
+        std::lock_guard<std::mutex> guard(commitLock(userID));
+        writers--;
+        return nullptr;
+    }
+    return std::unique_ptr<StorageWriter>(new TieredWriter(std::move(writer), other, this, _catalog, commitLock(userID), writers, entry));
+}
+
+std::unique_ptr<StorageReader> TieredStorage::open(uint32_t userID, const std::string& filename)
+{
+    // a commit replaces the data and its checksum under the same lock
+    std::lock_guard<std::mutex> guard(commitLock(userID));
+    CatalogEntry entry;
+
+    if (!_catalog->lookup(userID, filename, &entry))
+        return nullptr;
+    return tier(entry.location)->open(userID, filename);
+}
+
+uint16_t TieredStorage::erase(uint32_t userID, const std::string& filename)
+{
+    ReclaimJob job;
+
+    {
+        std::lock_guard<std::mutex> guard(commitLock(userID));
+        CatalogEntry entry;
+
+        if (!_catalog->lookup(userID, filename, &entry))
+            return FILE_NOT_FOUND;
+
+        // the erase is logged first, so a restart finishes it even if the catalog is rebuilt
+        {
+            std::lock_guard<std::mutex> guard(_reclaimLock);
+            _pendingErases[std::make_pair(userID, filename)]++;
+            logReclaim('E', userID, filename);
+        }
+        if (!_catalog->remove(userID, filename))
+            return GENERAL_ERROR;
+
+        job.userID = userID;
+        job.filename = filename;
+        job.location = entry.location;
+    }
+
+    // the file is gone for the client already, the data is deleted later
+    std::lock_guard<std::mutex> guard(_reclaimLock);
+    _reclaimQueue.push_back(job);
+    _reclaimReady.notify_one();
+    return ERASE_FILE_SUCCESS;
+}
+
+
+/*
+* delete the data of an erased file from its tier, unless the file was backed up again
+* in the meantime. the client's directory is deleted with its last file.
+*/
+void TieredStorage::reclaim(const ReclaimJob& job)
+{
+    std::lock_guard<std::mutex> guard(commitLock(job.userID));
+    CatalogEntry entry;
+
+    // a new backup under the same name already replaced the old data
+    if (!_catalog->lookup(job.userID, job.filename, &entry)) {
+        tier(job.location)->erase(job.userID, job.filename);
+        _versions.erase(job.userID, job.filename);
+
+        // the directory of a client with an upload in flight is kept, it goes with the next erase
+        if (!_catalog->hasUser(job.userID) && _writers[job.userID % 64] == 0) {
+            std::string dir = clientDir(job.userID);
+            _segments.drop(job.userID);
+            if (boost::filesystem::remove_all(dir) > 0)
+                std::cout << "Removed empty client directory " << dir << std::endl;
+        }
+    }
+
+    // the last queued job of the file clears it from the log. an empty log is truncated
+    std::lock_guard<std::mutex> logGuard(_reclaimLock);
+    auto pending = _pendingErases.find(std::make_pair(job.userID, job.filename));
+    if (pending == _pendingErases.end() || --pending->second > 0)
+        return;
+    _pendingErases.erase(pending);
+    if (_pendingErases.empty()) {
+        _reclaimLog.close();
+        _reclaimLog.open(_reclaimLogPath, std::ios::out | std::ios::trunc);
+    }
+    else {
+        logReclaim('C', job.userID, job.filename);
+    }
+}
+
+
+/*
+* a new backup of a file with a queued erase. the erase must not be redone after a restart.
+* the caller holds the client's commit lock
+*/
+void TieredStorage::cancelReclaim(uint32_t userID, const std::string& filename)
+{
+    std::lock_guard<std::mutex> guard(_reclaimLock);
+
+    if (_pendingErases.count(std::make_pair(userID, filename)))
+        logReclaim('C', userID, filename);
+}
+
+
+/*
+* append a record to the reclaim log: E for an erase, C when it is done or cancelled.
+* the caller holds _reclaimLock
+*/
+void TieredStorage::logReclaim(char type, uint32_t userID, const std::string& filename)
+{
+    if (!_reclaimLog.is_open())
+        return;
+    _reclaimLog << type << " " << userID << " " << filename << "\n" << std::flush;
+    if (!_reclaimLog)
+        std::cerr << "Error writing " << _reclaimLogPath << "\n";
+}
+
+
+/*
+* finish the erases that were logged before the last shutdown, then start a new log.
+* this runs before the catalog is rebuilt, so erased files can not come back from the disk.
+* catalogOpen tells whether the erased files still have to be removed from the catalog
+*/
+bool TieredStorage::openReclaimLog(const std::string& path, bool catalogOpen)
+{
+    std::map<std::pair<uint32_t, std::string>, char> last;
+    std::ifstream log(path);
+    std::string line;
+    size_t finished = 0;
+
+    while (std::getline(log, line)) {
+        std::istringstream record(line);
+        char type = 0;
+        uint32_t userID = 0;
+        std::string filename;
+
+        record >> type >> userID;
+        record.get();
+        std::getline(record, filename);
+        if (record.fail() || filename.empty() || (type != 'E' && type != 'C'))
+            continue; // a record that was cut off by a crash
+        last[std::make_pair(userID, filename)] = type;
+    }
+    log.close();
+
+    for (const auto& file : last) {
+        if (file.second != 'E')
+            continue;
+
+        // a file still in the catalog was backed up again before the cancel record was written
+        CatalogEntry entry;
+        if (catalogOpen && _catalog->lookup(file.first.first, file.first.second, &entry))
+            continue;
+
+        // the tier is not logged, a file is in at most one of them
+        _files.erase(file.first.first, file.first.second);
+        _segments.erase(file.first.first, file.first.second);
+        _versions.erase(file.first.first, file.first.second);
+        finished++;
+    }
+    if (finished > 0)
+        std::cout << "Finished " << finished << " erases from " << path << std::endl;
+
+    _reclaimLogPath = path;
+    _reclaimLog.open(path, std::ios::out | std::ios::trunc);
+    return _reclaimLog.is_open();
+}
+
+
+/*
+* background thread that deletes erased files, at most _reclaimRate files per second
+* so that the unlinks don't compete with the clients' I/O
+*/
+void TieredStorage::reclaimLoop()
+{
+    for (;;)
+    {
+        ReclaimJob job;
+        {
+            std::unique_lock<std::mutex> guard(_reclaimLock);
+            _reclaimReady.wait(guard, [this]() { return !_reclaimQueue.empty(); });
+            job = _reclaimQueue.front();
+            _reclaimQueue.pop_front();
+        }
+
+        try
+        {
+            reclaim(job);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Exception in thread, reclaimLoop: " << e.what() << "\n";
+        }
+
+        if (_reclaimRate > 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(1000000 / _reclaimRate));
+    }
+}
+
+std::vector<std::string> TieredStorage::list(uint32_t userID)
+{
+    return _catalog->list(userID);
+}
+
+
+/*
+* the live file followed by its kept versions, newest first
+*/
+std::vector<FileVersion> TieredStorage::versions(uint32_t userID, const std::string& filename)
+{
+    std::vector<FileVersion> versions;
+    CatalogEntry entry;
+
+    if (!_catalog->lookup(userID, filename, &entry))
+        return versions;
+
+    FileVersion current;
+    current.version = entry.mtime;
+    current.size = entry.size;
+    current.crc = entry.crc;
+    versions.push_back(current);
+
+    for (const FileVersion& version : _versions.list(userID, filename))
+        versions.push_back(version);
+    return versions;
+}
+
+
+/*
+* the newest version of the file that is not newer than asOf
+*/
+std::unique_ptr<StorageReader> TieredStorage::openVersion(uint32_t userID, const std::string& filename, int64_t asOf)
+{
+    std::lock_guard<std::mutex> guard(commitLock(userID));
+    CatalogEntry entry;
+
+    if (!_catalog->lookup(userID, filename, &entry))
+        return nullptr;
+    if (entry.mtime <= asOf)
+        return tier(entry.location)->open(userID, filename);
+    return _versions.open(userID, filename, asOf);
+}
+
+
+/*
+* copy the live file that is described by replaced aside before a new backup replaces it.
+* the caller holds the client's commit lock and passes the copy to keepVersion or dropVersion
+*/
+std::string TieredStorage::stageVersion(const CatalogEntry& replaced)
+{
+    // with a single version to keep there is nothing to keep besides the live file
+    if (_keepLast <= 1 && _keepDaily == 0)
+        return "";
+
+    try
+    {
+        std::string staged = _versions.stage(replaced, tier(replaced.location));
+        if (staged.empty())
+            std::cout << "Cannot keep the previous version of " << replaced.filename << std::endl;
+        return staged;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Exception in thread, stageVersion: " << e.what() << "\n";
+        return "";
+    }
+}
+
+
+/*
+* the new backup is committed, the staged copy of the replaced file becomes an older version.
+* the caller holds the client's commit lock
+*/
+void TieredStorage::keepVersion(const CatalogEntry& replaced, const std::string& staged)
+{
+    if (staged.empty())
+        return;
+
+    try
+    {
+        if (!_versions.keep(replaced, staged)) {
+            std::cout << "Cannot keep the previous version of " << replaced.filename << std::endl;
+            _versions.drop(staged);
+            return;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Exception in thread, keepVersion: " << e.what() << "\n";
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(_pruneLock);
+    _pruneQueue.insert(std::make_pair(replaced.userID, replaced.filename));
+    _pruneReady.notify_one();
+}
+
+
+void TieredStorage::dropVersion(const std::string& staged)
+{
+    if (!staged.empty())
+        _versions.drop(staged);
+}
+
+
+/*
+* the new backup described by entry was committed to its tier but the catalog did not take it.
+* the new data is deleted again, so the disk matches the catalog. when it replaced the data of
+* replaced in the same tier, that entry is dropped too, and its staged copy is kept as a version.
+* the caller holds the client's commit lock
+*/
+void TieredStorage::rollback(const CatalogEntry& entry, const CatalogEntry* replaced, const std::string& staged)
+{
+    std::cerr << "Catalog update failed, rolling back the backup of " << entry.filename << "\n";
+
+    try
+    {
+        tier(entry.location)->erase(entry.userID, entry.filename);
+        if (replaced && replaced->location == entry.location) {
+            _catalog->remove(entry.userID, entry.filename);
+            keepVersion(*replaced, staged);
+            return;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Exception in thread, rollback: " << e.what() << "\n";
+    }
+    dropVersion(staged);
+}
+
+
+/*
+* the server is stopping: wait for the commits in flight and mark the catalog as closed
+* cleanly. the commit locks are not released, no backup is committed after this
+*/
+void TieredStorage::close()
+{
+    for (std::mutex& lock : _commitLocks)
+        lock.lock();
+    _catalog->close();
+}
+
+
+/*
+* background thread that applies the retention policy. a file is pruned after it got a new
+* version, and all the files are swept every PRUNE_INTERVAL seconds because versions also
+* age out of the daily window. deletes are rate limited like the reclaimer's
+*/
+void TieredStorage::pruneLoop()
+{
+    std::chrono::steady_clock::time_point sweep = std::chrono::steady_clock::now();
+
+    for (;;)
+    {
+        std::pair<uint32_t, std::string> file;
+        {
+            std::unique_lock<std::mutex> guard(_pruneLock);
+            if (!_pruneReady.wait_until(guard, sweep, [this]() { return !_pruneQueue.empty(); })) {
+                std::vector<std::pair<uint32_t, std::string>> files;
+                guard.unlock();
+                sweep = std::chrono::steady_clock::now() + std::chrono::seconds(PRUNE_INTERVAL);
+
+                try
+                {
+                    for (uint32_t userID : findClients(_config.root))
+                        for (const std::string& filename : _versions.files(userID))
+                            files.push_back(std::make_pair(userID, filename));
+                }
+                catch (const std::exception& e)
+                {
+                    std::cerr << "Exception in thread, pruneLoop: " << e.what() << "\n";
+                }
+
+                guard.lock();
+                _pruneQueue.insert(files.begin(), files.end());
+                continue;
+            }
+            file = *_pruneQueue.begin();
+            _pruneQueue.erase(_pruneQueue.begin());
+        }
+
+        size_t removed = 0;
+        try
+        {
+            std::lock_guard<std::mutex> guard(commitLock(file.first));
+            CatalogEntry entry;
+            int64_t current = _catalog->lookup(file.first, file.second, &entry) ? entry.mtime : 0;
+            removed = _versions.prune(file.first, file.second, current, _keepLast, _keepDaily);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Exception in thread, pruneLoop: " << e.what() << "\n";
+        }
+
+        if (removed > 0)
+            std::cout << "Pruned " << removed << " versions of " << file.second << std::endl;
+        if (_reclaimRate > 0 && removed > 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(removed * 1000000 / _reclaimRate));
+    }
+}
+
+
+/*
+* add everything that is stored for the client to the catalog
+*/
+void TieredStorage::addToCatalog(uint32_t userID)
+{
+    std::string dir = clientDir(userID);
+    boost::system::error_code error;
+
+    for (const std::string& filename : _files.list(userID)) {
+        std::string path = joinPath(dir, filename);
+        CatalogEntry entry;
+        entry.userID = userID;
+        entry.filename = filename;
+        entry.size = boost::filesystem::file_size(path);
+        entry.mtime = (int64_t)boost::filesystem::last_write_time(path);
+        entry.location = LOCATION_FILE;
+
+        // files without a sidecar get their checksum now
+        if (!readChecksumFile(path, &entry.crc)) {
+            std::vector<uint8_t> chunk(FILE_IO_CHUNK);
+            std::ifstream file(path, std::ios::in | std::ios::binary);
+            while (file) {
+                file.read((char*)chunk.data(), chunk.size());
+                entry.crc = crc32c(entry.crc, chunk.data(), (size_t)file.gcount());
+            }
+            writeChecksumFile(path, entry.crc);
+        }
+        _catalog->put(entry);
+    }
+
+    for (const auto& packed : _segments.entries(userID)) {
+        CatalogEntry entry;
+        entry.userID = userID;
+        entry.filename = packed.first;
+        entry.size = packed.second.length;
+        entry.mtime = (int64_t)boost::filesystem::last_write_time(segmentPath(joinPath(dir, SEGMENT_DIR), packed.second.segment), error);
+        entry.crc = packed.second.crc;
+        entry.location = LOCATION_SEGMENT;
+        _catalog->put(entry);
+    }
+}
+
+
+/*
+* recovery path: add every client directory under the storage root to the (empty) catalog
+*/
+void TieredStorage::rebuildCatalog(const std::string& root)
+{
+    uint64_t clients = 0;
+
+    for (uint32_t userID : findClients(root)) {
+        addToCatalog(userID);
+        clients++;
+    }
+    std::cout << "Catalog rebuilt from " << root << ": " << clients << " clients" << std::endl;
+}
+
+
+/*
+* walk the storage root and return the ids of all the client directories.
+* with the sharded layout the client directories are two levels below the root,
+* client directories that were not moved into their shard yet sit right under the root.
+* a flat client directory can have a two digit name, so a top level directory only counts
+* as a shard when it holds shard directories itself.
+*/
+std::vector<uint32_t> findClients(const std::string& root)
+{
+    boost::filesystem::recursive_directory_iterator it(root), end;
+    std::vector<uint32_t> clients;
+
+    for (; it != end; ++it) {
+        std::string name = it->path().filename().string();
+        if (!boost::filesystem::is_directory(it->status()))
+            continue;
+
+        // only shards are walked into, so every directory below the root level is in a shard
+        if (_config.sharded && (it.depth() == 1 || (it.depth() == 0 && isShardDir(it->path()))))
+            continue;
+
+        // anything else is either a client directory or not ours. don't descend into it
+        it.no_push();
+
+        if (name.empty() || name.size() > 10 || name.find_first_not_of("0123456789") != std::string::npos)
+            continue;
+
+        unsigned long long id = std::strtoull(name.c_str(), nullptr, 10);
+        if (id > 0xFFFFFFFFull)
+            continue;
+
+        clients.push_back((uint32_t)id);
+    }
+    return clients;
+}
+
+
+/*
+* map the whole catalog file
+*/
+bool Catalog::map()
+{
+    _region = boost::interprocess::mapped_region();
+    _file = boost::interprocess::file_mapping(_path.c_str(), boost::interprocess::read_write);
+    _region = boost::interprocess::mapped_region(_file, boost::interprocess::read_write);
+    return true;
+}
+
+CatalogHeader* Catalog::header()
+{
+    return (CatalogHeader*)_region.get_address();
+}
+
+uint64_t* Catalog::fileBuckets()
+{
+    return (uint64_t*)((uint8_t*)_region.get_address() + sizeof(CatalogHeader));
+}
+
+uint64_t* Catalog::userBuckets()
+{
+    return fileBuckets() + header()->buckets;
+}
+
+CatalogRecord* Catalog::record(uint64_t offset)
+{
+    return (CatalogRecord*)((uint8_t*)_region.get_address() + offset);
+}
+
+static uint32_t catalogHash(uint32_t userID, const std::string* filename)
+{
+    uint8_t bytes[4] = { (uint8_t)userID, (uint8_t)(userID >> 8), (uint8_t)(userID >> 16), (uint8_t)(userID >> 24) };
+    uint32_t hash = crc32c(0, bytes, sizeof(bytes));
+    if (filename)
+        hash = crc32c(hash, (const uint8_t*)filename->data(), filename->size());
+    return hash;
+}
+
+static uint64_t catalogRecordSize(uint16_t nameLen)
+{
+    return sizeof(CatalogRecord) + ((nameLen + 7) & ~7);
+}
+
+
+/*
+* open an existing catalog. returns false if it is missing or not valid,
+* the caller then creates a new one and rebuilds it.
+*/
+bool Catalog::open(const std::string& path)
+{
+    std::unique_lock<std::shared_mutex> guard(_lock);
+    _path = path;
+
+    try
+    {
+        if (!boost::filesystem::exists(path) || boost::filesystem::file_size(path) < sizeof(CatalogHeader))
+            return false;
+        map();
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Exception in Catalog::open: " << e.what() << "\n";
+        return false;
+    }
+
+    CatalogHeader* h = header();
+    if (h->magic != CATALOG_MAGIC || h->version != CATALOG_VERSION ||
+        h->buckets == 0 || (h->buckets & (h->buckets - 1)) != 0 ||
+        h->dataStart != sizeof(CatalogHeader) + 2 * (uint64_t)h->buckets * sizeof(uint64_t) ||
+        h->dataEnd < h->dataStart || h->dataEnd > _region.get_size()) {
+        std::cerr << "Catalog " << path << " is not valid\n";
+        _region = boost::interprocess::mapped_region();
+        return false;
+    }
+
+    // backups that were committed after the last update of the catalog are only found by a rebuild
+    if (h->clean != 1) {
+        std::cerr << "Catalog " << path << " was not closed cleanly\n";
+        _region = boost::interprocess::mapped_region();
+        return false;
+    }
+    h->clean = 0;
+    _region.flush();
+    return true;
+}
+
+
+/*
+* mark the catalog as closed cleanly, the next start uses it without a rebuild
+*/
+void Catalog::close()
+{
+    std::unique_lock<std::shared_mutex> guard(_lock);
+
+    if (_region.get_address() == nullptr)
+        return;
+    header()->clean = 1;
+    _region.flush();
+}
+
+
+/*
+* create a new empty catalog, replacing any file at path
+*/
+bool Catalog::create(const std::string& path)
+{
+    std::unique_lock<std::shared_mutex> guard(_lock);
+    uint64_t dataStart = sizeof(CatalogHeader) + 2 * (uint64_t)CATALOG_BUCKETS * sizeof(uint64_t);
+
+    _path = path;
+    _region = boost::interprocess::mapped_region();
+
+    try
+    {
+        std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        file.close();
+        boost::filesystem::resize_file(path, dataStart + CATALOG_INITIAL_DATA);
+        map();
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Exception in Catalog::create: " << e.what() << "\n";
+        return false;
+    }
+
+    CatalogHeader* h = header();
+    memset(h, 0, sizeof(CatalogHeader));
+    h->version = CATALOG_VERSION;
+    h->buckets = CATALOG_BUCKETS;
+    h->dataStart = dataStart;
+    h->dataEnd = dataStart;
+    h->magic = CATALOG_MAGIC;
+    _region.flush();
+    return true;
+}
+
+
+/*
+* make room for at least needed more bytes of records by doubling the file and mapping it again
+*/
+bool Catalog::grow(uint64_t needed)
+{
+    uint64_t size = _region.get_size();
+    uint64_t newSize = size;
+
+    while (newSize - header()->dataEnd < needed)
+        newSize *= 2;
+    if (newSize == size)
+        return true;
+
+    try
+    {
+        _region.flush();
+        _region = boost::interprocess::mapped_region();
+        boost::filesystem::resize_file(_path, newSize);
+        map();
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Exception in Catalog::grow: " << e.what() << "\n";
+        return false;
+    }
+    return true;
+}
+
+
+/*
+* offset of the live record of the file, 0 if there is none. the caller holds the lock
+*/
+uint64_t Catalog::findLive(uint32_t userID, const std::string& filename)
+{
+    uint64_t offset = fileBuckets()[catalogHash(userID, &filename) & (header()->buckets - 1)];
+
+    while (offset) {
+        CatalogRecord* r = record(offset);
+        if (r->live && r->userID == userID && r->nameLen == filename.size() &&
+            memcmp((const char*)(r + 1), filename.data(), filename.size()) == 0)
+            return offset;
+        offset = r->nextFile;
+    }
+    return 0;
+}
+
+void Catalog::markDead(uint64_t offset)
+{
+    CatalogRecord* r = record(offset);
+    r->live = 0;
+    header()->liveRecords--;
+    header()->deadBytes += catalogRecordSize(r->nameLen);
+}
+
+
+/*
+* add or replace the record of a file
+*/
+bool Catalog::put(const CatalogEntry& entry)
+{
+    std::unique_lock<std::shared_mutex> guard(_lock);
+    uint64_t size = catalogRecordSize((uint16_t)entry.filename.size());
+
+    if (!_region.get_address() || !grow(size))
+        return false;
+
+    CatalogHeader* h = header();
+    uint64_t* fileBucket = &fileBuckets()[catalogHash(entry.userID, &entry.filename) & (h->buckets - 1)];
+    uint64_t* userBucket = &userBuckets()[catalogHash(entry.userID, nullptr) & (h->buckets - 1)];
+    uint64_t offset = h->dataEnd;
+    uint64_t old = findLive(entry.userID, entry.filename);
+
+    // write the record first, then publish it. a crash in between only leaks the record
+    CatalogRecord* r = record(offset);
+    memset(r, 0, size);
+    r->nextFile = *fileBucket;
+    r->nextUser = *userBucket;
+    r->userID = entry.userID;
+    r->live = 1;
+    r->location = entry.location;
+    r->nameLen = (uint16_t)entry.filename.size();
+    r->size = entry.size;
+    r->mtime = entry.mtime;
+    r->crc = entry.crc;
+    memcpy((char*)(r + 1), entry.filename.data(), entry.filename.size());
+
+    h->dataEnd = offset + size;
+    h->liveRecords++;
+    *fileBucket = offset;
+    *userBucket = offset;
+    if (old)
+        markDead(old);
+
+    _region.flush(0, 0, true);
+    return true;
+}
+
+
+bool Catalog::lookup(uint32_t userID, const std::string& filename, CatalogEntry* entry)
+{
+    std::shared_lock<std::shared_mutex> guard(_lock);
+
+    if (!_region.get_address())
+        return false;
+
+    uint64_t offset = findLive(userID, filename);
+    if (!offset)
+        return false;
+
+    CatalogRecord* r = record(offset);
+    entry->userID = userID;
+    entry->filename = filename;
+    entry->size = r->size;
+    entry->mtime = r->mtime;
+    entry->crc = r->crc;
+    entry->location = r->location;
+    return true;
+}
+
+
+bool Catalog::remove(uint32_t userID, const std::string& filename)
+{
+    std::unique_lock<std::shared_mutex> guard(_lock);
+
+    if (!_region.get_address())
+        return false;
+
+    uint64_t offset = findLive(userID, filename);
+    if (!offset)
+        return false;
+
+    markDead(offset);
+    _region.flush(0, 0, true);
+    return true;
+}
+
+
+/*
+* names of all the live files of the client, sorted
+*/
+std::vector<std::string> Catalog::list(uint32_t userID)
+{
+    std::shared_lock<std::shared_mutex> guard(_lock);
+    std::vector<std::string> listOfFiles;
+
+    if (!_region.get_address())
+        return listOfFiles;
+
+    uint64_t offset = userBuckets()[catalogHash(userID, nullptr) & (header()->buckets - 1)];
+    while (offset) {
+        CatalogRecord* r = record(offset);
+        if (r->live && r->userID == userID)
+            listOfFiles.push_back(std::string((const char*)(r + 1), r->nameLen));
+        offset = r->nextUser;
+    }
+
+    std::sort(listOfFiles.begin(), listOfFiles.end());
+    return listOfFiles;
+}
+
+
+bool Catalog::hasUser(uint32_t userID)
+{
+    std::shared_lock<std::shared_mutex> guard(_lock);
+
+    if (!_region.get_address())
+        return false;
+
+    uint64_t offset = userBuckets()[catalogHash(userID, nullptr) & (header()->buckets - 1)];
+    while (offset) {
+        CatalogRecord* r = record(offset);
+        if (r->live && r->userID == userID)
+            return true;
+        offset = r->nextUser;
+    }
+    return false;
+}
+
+
+/*
+* true when most of the record area holds dead records
+*/
+bool Catalog::needsCompaction()
+{
+    std::shared_lock<std::shared_mutex> guard(_lock);
+    CatalogHeader* h = header();
+
+    return h->deadBytes > CATALOG_INITIAL_DATA && h->deadBytes * 2 > h->dataEnd - h->dataStart;
+}
+
+
+/*
+* copy the live records into a new catalog file and replace the current file with it
+*/
+bool Catalog::compact()
+{
+    std::string tempPath = _path + ".tmp";
+    Catalog compacted;
+
+    if (!compacted.create(tempPath))
+        return false;
+
+    {
+        std::shared_lock<std::shared_mutex> guard(_lock);
+        CatalogHeader* h = header();
+
+        for (uint64_t offset = h->dataStart; offset < h->dataEnd; ) {
+            CatalogRecord* r = record(offset);
+            if (r->live) {
+                CatalogEntry entry;
+                entry.userID = r->userID;
+                entry.filename = std::string((const char*)(r + 1), r->nameLen);
+                entry.size = r->size;
+                entry.mtime = r->mtime;
+                entry.crc = r->crc;
+                entry.location = r->location;
+                if (!compacted.put(entry))
+                    return false;
+            }
+            offset += catalogRecordSize(r->nameLen);
+        }
+    }
+
+    compacted._region.flush();
+    compacted._region = boost::interprocess::mapped_region();
+    compacted._file = boost::interprocess::file_mapping();
+
+    std::unique_lock<std::shared_mutex> guard(_lock);
+    _region = boost::interprocess::mapped_region();
+    _file = boost::interprocess::file_mapping();
+    boost::filesystem::rename(tempPath, _path);
+    map();
+    std::cout << "Catalog compacted: " << header()->liveRecords << " live records" << std::endl;
+    return true;
+}
+
+
+
+/*-----------------------------------------------------------------------------------------------------------------*/
+/* Restore cache */
+
+
+FileCache::FileCache(uint64_t budget)
+    : _shardBudget(budget / CACHE_SHARDS), _hits(0), _misses(0), _coalesced(0), _evictions(0)
+{
+}
+
+
+/*
+* a file is cached only if it takes at most a quarter of a shard
+*/
+bool FileCache::cacheable(uint64_t size)
+{
+    return size > 0 && size <= _shardBudget / 4;
+}
+
+
+/*
+* return the cached contents under key. on a miss, load() reads them from the disk;
+* requests for the same key that arrive meanwhile wait for that read instead of doing their own.
+* returns nullptr if load() failed.
+*/
+FileCache::Data FileCache::get(const std::string& key, std::function<bool(std::vector<uint8_t>&)> load)
+{
+    Shard& shard = _shards[crc32c(0, (const uint8_t*)key.data(), key.size()) % CACHE_SHARDS];
+    std::promise<Data> promise;
+    std::shared_future<Data> pending;
+
+    {
+        std::lock_guard<std::mutex> guard(shard.lock);
+
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end()) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            _hits++;
+            return it->second->second;
+        }
+
+        auto loading = shard.loading.find(key);
+        if (loading != shard.loading.end()) {
+            pending = loading->second;
+            _coalesced++;
+        }
+        else {
+            shard.loading[key] = promise.get_future().share();
+            _misses++;
+        }
+    }
+
+    if (pending.valid())
+        return pending.get();
+
+    std::shared_ptr<std::vector<uint8_t>> buf(new std::vector<uint8_t>);
+    Data data;
+    try
+    {
+        if (load(*buf))
+            data = buf;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Exception in thread, FileCache::get: " << e.what() << "\n";
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(shard.lock);
+
+        shard.loading.erase(key);
+        if (data) {
+            shard.lru.emplace_front(key, data);
+            shard.entries[key] = shard.lru.begin();
+            shard.bytes += data->size();
+
+            while (shard.bytes > _shardBudget) {
+                shard.bytes -= shard.lru.back().second->size();
+                shard.entries.erase(shard.lru.back().first);
+                shard.lru.pop_back();
+                _evictions++;
+            }
+        }
+    }
+
+    promise.set_value(data);
+    return data;
+}
+
+
+std::vector<std::string> FileCache::stats()
+{
+    std::vector<std::string> lines;
+    uint64_t bytes = 0;
+    uint64_t files = 0;
+    uint64_t hits = _hits + _coalesced;
+    uint64_t total = hits + _misses;
+
+    for (Shard& shard : _shards) {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        bytes += shard.bytes;
+        files += shard.entries.size();
+    }
+
+    lines.push_back("cache_hits " + std::to_string(_hits));
+    lines.push_back("cache_coalesced " + std::to_string(_coalesced));
+    lines.push_back("cache_misses " + std::to_string(_misses));
+    lines.push_back("cache_evictions " + std::to_string(_evictions));
+    lines.push_back("cache_hit_ratio " + std::to_string(total ? (double)hits / total : 0.0));
+    lines.push_back("cache_files " + std::to_string(files));
+    lines.push_back("cache_bytes " + std::to_string(bytes));
+    lines.push_back("cache_budget_bytes " + std::to_string(_shardBudget * CACHE_SHARDS));
+    return lines;
+}
+
+
+/*
+* metrics of the whole server, one "name value" per line
+*/
+std::vector<std::string> serverStats()
+{
+    std::vector<std::string> lines = _cache->stats();
+
+    lines.push_back("sessions_active " + std::to_string(Connection::active));
+    lines.push_back("sessions_rejected " + std::to_string(Connection::rejected));
+    lines.push_back("sessions_evicted_header " + std::to_string(Connection::evictedHeader));
+    lines.push_back("sessions_evicted_idle " + std::to_string(Connection::evictedIdle));
+    lines.push_back("sessions_evicted_deadline " + std::to_string(Connection::evictedDeadline));
+    lines.push_back("sessions_evicted_slow " + std::to_string(Connection::evictedSlow));
+    return lines;
+}
+
+
+
+std::string generateRandomAlphaNum(const int len)
+{
+    std::string s = "";
+    std::string chars =
+        "0123456789"
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+        "abcdefghijklmnopqrstuvwxyz";
+
+    s.reserve(len);
+    boost::random::random_device rng;
+    boost::random::uniform_int_distribution<> index_dist(0, chars.size() - 1);
+    
+    for (int i = 0; i < len; i++) {
+        s += chars[index_dist(rng)];
+    }
+    return s;
+}
+
+
+/*
+* creating a text file that saves the dir list.
+* (not used in the project due to some clarifications in the mmn14 forum).
+*/
+std::string createDirListFile(std::string path, std::vector<std::string> dirList)
+{
+    // create 32 random alpha-numeric character sequence
+    std::string seq = generateRandomAlphaNum(32) + ".txt";
+    
+    // attempt to open the file
+    std::ofstream file;
+    try
+    {
+        file.open(joinPath(path, seq));
+        if (!file)
+            throw std::runtime_error("File not open");
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Exception in thread, createDirListFile: " << e.what() << "\n";
+        return "";
+    }
+
+
+
+    std::cout << "Creating list of files for client: " << seq << std::endl;
+    try
+    {
+        for (std::size_t i = 0; i < dirList.size(); i++) {
+            file << dirList[i] << std::endl;
+        }       
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Exception in thread, createDirListFile: " << e.what() << "\n";
+        return "";
+    }
+
+    file.close();
+    return seq;
+}
+
+
+/*
+* modifies the server's response according to the given parameters
+* and reflects that in the contents of a given response array: resArr.
 */
 std::vector<uint8_t> buildResponse( Response* response,
                     uint16_t retCode,
@@ -678,67 +3240,214 @@ std::vector<uint8_t> buildResponse( Response* response,
        payload    variable number of bytes
     */
     
+    // the response is in the format of the request's version (see session)
+    uint8_t version = response->version ? response->version : VERSION_SERVER;
+
+    // from version 2 on the header always carries exactly nameLen filename bytes and the size
+    // field, so the client can read it with exact length reads. version 1 leaves out an empty
+    // filename and a size of 0
+    bool exact = version >= 2;
+    if (exact)
+        nameLen = (uint16_t)std::min<size_t>(nameLen, filename.size());
+
     // modify response struct
-    response->version = VERSION_SERVER;
+    response->version = version;
     response->status = retCode;
     response->nameLen = nameLen;
     response->filename = filename;
     response->size = size;
 
     std::vector<uint8_t> resArr;
-    resArr.push_back(VERSION_SERVER);
+    resArr.push_back(version);
     resArr.push_back((uint8_t)retCode);
     resArr.push_back((uint8_t)(retCode >> 8));
     resArr.push_back((uint8_t)nameLen);
     resArr.push_back((uint8_t)(nameLen >> 8));
     
-    if (!filename.empty()) {
-        for (int i = 0; i < nameLen; i++)
-            resArr.push_back(filename[i]);
+    for (size_t i = 0; i < nameLen && i < filename.size(); i++)
+        resArr.push_back(filename[i]);
+
+    if (exact || size) {
+        resArr.push_back((uint8_t)(size));
+        resArr.push_back((uint8_t)(size >> 8));
+        resArr.push_back((uint8_t)(size >> 16));
+        resArr.push_back((uint8_t)(size >> 24));
+    }
+    return resArr;
+}
+
+
+
+
+
+/*
+* create a backup directory for the specified user id.
+* this directory will be created inside the storage root (see clientDir).
+* also checks if the directory already exists.
+* return true upon success, else return false.
+*/
+bool mkdir(uint32_t userID)
+{
+    std::string path = clientDir(userID);
+    
+    std::cout << "path: " << path << std::endl;
+    
+
+    // if directory already exists, exit
+    if (boost::filesystem::exists(path))
+        return true;
+    
+    try
+    {
+        // the shard directories above the client's directory may not exist yet
+        boost::filesystem::create_directories(path);
+        return true;
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "Exception in thread, mkdir: " << e.what() << "\n";
+        return false;
+    }
+}
+
+
+
+/*
+* Returns the path of the backup directory of the specified user id.
+* with the flat layout this is <root>/<userid>. with the sharded layout the directory
+* is spread over two levels of shard directories named by a hash of the user id:
+* <root>/ab/cd/<userid>, so no single directory holds all the clients.
+*/
+std::string clientDir(uint32_t userID)
+{
+    std::string id = std::to_string(userID);
+    boost::filesystem::path root(_config.root);
+
+    if (!_config.sharded)
+        return (root / id).string();
+
+    uint8_t bytes[4] = { (uint8_t)userID, (uint8_t)(userID >> 8), (uint8_t)(userID >> 16), (uint8_t)(userID >> 24) };
+    uint32_t hash = crc32c(0, bytes, sizeof(bytes));
+    char level1[3], level2[3];
+    snprintf(level1, sizeof(level1), "%02x", (unsigned int)(hash & 0xFF));
+    snprintf(level2, sizeof(level2), "%02x", (unsigned int)((hash >> 8) & 0xFF));
+
+    return (root / level1 / level2 / id).string();
+}
+
+
+/*
+* move the client directories that are still in the flat layout into their shards. runs once
+* at startup, before anything else uses the storage root.
+* every flat directory is first moved aside to .moving-<userid>, because a shard can be named
+* like a flat client directory. the moves that were left over by an earlier start are finished too
+*/
+void migrateClients(const std::string& root)
+{
+    boost::system::error_code error;
+    std::vector<boost::filesystem::path> flat;
+
+    boost::filesystem::directory_iterator it(root, error), end;
+    for (; !error && it != end; it.increment(error)) {
+        std::string name = it->path().filename().string();
+        if (name.empty() || name.size() > 10 || name.find_first_not_of("0123456789") != std::string::npos ||
+            !boost::filesystem::is_directory(it->status()) || isShardDir(it->path()))
+            continue;
+        flat.push_back(it->path());
+    }
+
+    for (const boost::filesystem::path& dir : flat) {
+        boost::filesystem::path moving = boost::filesystem::path(root) / (".moving-" + dir.filename().string());
+        if (boost::filesystem::exists(moving, error)) {
+            std::cerr << "Cannot move " << dir.string() << " into its shard, " << moving.string() << " exists\n";
+            continue;
+        }
+        boost::filesystem::rename(dir, moving, error);
+        if (error)
+            std::cerr << "Error moving " << dir.string() << " into its shard: " << error.message() << "\n";
     }
-    if (size){
-        resArr.push_back((uint8_t)(size));
-        resArr.push_back((uint8_t)(size >> 8));
-        resArr.push_back((uint8_t)(size >> 16));
-        resArr.push_back((uint8_t)(size >> 24));
+
+    std::vector<boost::filesystem::path> moving;
+    boost::filesystem::directory_iterator next(root, error);
+    for (; !error && next != end; next.increment(error)) {
+        std::string name = next->path().filename().string();
+        if (name.compare(0, 8, ".moving-") == 0 && boost::filesystem::is_directory(next->status()))
+            moving.push_back(next->path());
+    }
+
+    for (const boost::filesystem::path& dir : moving) {
+        std::string id = dir.filename().string().substr(8);
+        if (id.empty() || id.size() > 10 || id.find_first_not_of("0123456789") != std::string::npos ||
+            std::strtoull(id.c_str(), nullptr, 10) > 0xFFFFFFFFull)
+            continue;
+
+        boost::filesystem::path sharded = clientDir((uint32_t)std::strtoull(id.c_str(), nullptr, 10));
+        if (boost::filesystem::exists(sharded, error)) {
+            std::cerr << "Cannot move " << dir.string() << " into its shard, " << sharded.string() << " exists\n";
+            continue;
+        }
+        boost::filesystem::create_directories(sharded.parent_path(), error);
+        boost::filesystem::rename(dir, sharded, error);
+        if (error)
+            std::cerr << "Error moving " << dir.string() << " into its shard: " << error.message() << "\n";
+        else
+            std::cout << "Moved client " << id << " to " << sharded.string() << std::endl;
     }
-    return resArr;
 }
 
 
+/*
+* true for a shard directory of the sharded layout: it holds directories with two hex digit
+* names. a flat client directory only holds files and the server's dot directories.
+*/
+bool isShardDir(const boost::filesystem::path& dir)
+{
+    boost::system::error_code error;
+    boost::filesystem::directory_iterator it(dir, error), end;
 
+    for (; !error && it != end; it.increment(error)) {
+        std::string name = it->path().filename().string();
+        if (name.size() == 2 && name.find_first_not_of("0123456789abcdef") == std::string::npos &&
+            boost::filesystem::is_directory(it->status()))
+            return true;
+    }
+    return false;
+}
 
 
 /*
-* create a backup directory for the specified user id.
-* this directory will be created inside the SERVER_BACKUP_PARENT_DIR const path.
-* also checks if the directory already exists.
-* return true upon success, else return false.
+* join a directory and a name with the separator of the current platform
 */
-bool mkdir(uint32_t userID)
+std::string joinPath(std::string dir, std::string name)
 {
-    std::string path = SERVER_BACKUP_PARENT_DIR;
-    path += std::to_string(userID);
-    
-    std::cout << "path: " << path << std::endl;
-    
+    return (boost::filesystem::path(dir) / name).string();
+}
 
-    // if directory already exists, exit
-    if (boost::filesystem::exists(path))
-        return true;
-    
-    try
-    {
-        boost::filesystem::create_directory(path);
-        return true;
-    }
-    catch (std::exception& e)
-    {
-        std::cerr << "Exception in thread, mkdir: " << e.what() << "\n";
+
+/*
+* checks that a filename received from a client names a single entry inside the
+* client's directory: no path separators, no drive letters, no "." or "..".
+* names that start with '.' or end with the checksum extension are reserved for the server.
+*/
+bool isSafeFilename(const std::string& filename)
+{
+    if (filename.empty() || filename.size() > MAX_FILENAME_LENGTH)
         return false;
+
+    if (filename[0] == '.')
+        return false;
+
+    for (char c : filename) {
+        if (c == '/' || c == '\\' || c == ':' || (unsigned char)c < 0x20)
+            return false;
     }
-}
 
+    if (filename.size() >= strlen(CHECKSUM_FILE_EXT) &&
+        filename.compare(filename.size() - strlen(CHECKSUM_FILE_EXT), std::string::npos, CHECKSUM_FILE_EXT) == 0)
+        return false;
+
+    return true;
+}
 
 
 /*
@@ -755,23 +3464,521 @@ bool findId(std::list<uint32_t > list, uint32_t id)
 
 
 /*
-* Infinite loop that listens to incoming client connections.
+* Connection: the socket of a client session with per-phase deadlines.
+* every read and write is started asynchronously and the session thread runs the io_context
+* until either the operation or the steady timer that guards it completes. a timer that fires
+* first cancels the socket operation and the client is evicted.
+*/
+std::atomic<uint64_t> Connection::active(0);
+std::atomic<uint64_t> Connection::rejected(0);
+std::atomic<uint64_t> Connection::evictedHeader(0);
+std::atomic<uint64_t> Connection::evictedIdle(0);
+std::atomic<uint64_t> Connection::evictedDeadline(0);
+std::atomic<uint64_t> Connection::evictedSlow(0);
+
+Connection::Connection(boost::asio::io_context& io, tcp::socket sock)
+    : _io(io), _sock(std::move(sock)), _timer(io),
+      _idle(std::chrono::seconds(IDLE_TIMEOUT)),
+      _deadline(std::chrono::steady_clock::now() + std::chrono::seconds(TRANSFER_TIMEOUT))
+{
+}
+
+
+Connection::~Connection()
+{
+    boost::system::error_code ignored;
+    _sock.shutdown(tcp::socket::shutdown_both, ignored);
+    _sock.close(ignored);
+    active--;
+}
+
+
+/*
+* start a phase of the session: each read or write has to complete within idle seconds
+* and the whole phase within total seconds. a client that times out while the request
+* header is read is counted apart from the ones that time out later
+*/
+void Connection::setDeadline(uint32_t idle, uint32_t total, bool header)
+{
+    _header = header;
+    _idle = std::chrono::seconds(idle);
+    _deadline = std::chrono::steady_clock::now() + std::chrono::seconds(total);
+}
+
+
+/*
+* from now on the client has to keep up the minimum transfer rate
+*/
+void Connection::startTransfer()
+{
+    _transferStart = std::chrono::steady_clock::now();
+    _transferred = 0;
+    _transferring = true;
+}
+
+
+/*
+* push bytes back so that the next reads return them before reading the socket
+*/
+void Connection::unread(const uint8_t* data, size_t length)
+{
+    _pending.insert(_pending.begin(), data, data + length);
+}
+
+
+size_t Connection::readSome(boost::asio::mutable_buffer buffer, boost::system::error_code& error)
+{
+    size_t length = 0;
+
+    error = boost::system::error_code();
+    if (!_pending.empty()) {
+        length = std::min(buffer.size(), _pending.size());
+        std::memcpy(buffer.data(), _pending.data(), length);
+        _pending.erase(_pending.begin(), _pending.begin() + length);
+        return length;
+    }
+
+    std::chrono::steady_clock::duration limit = timeout(error);
+    if (error)
+        return 0;
+
+    error = boost::asio::error::would_block;
+    _sock.async_read_some(buffer, [&](const boost::system::error_code& ec, size_t n) {
+        error = ec;
+        length = n;
+    });
+    wait(limit, error);
+    if (!error)
+        account(length, error);
+    return length;
+}
+
+
+/*
+* write the whole buffer. throws if the client failed or was evicted
+*/
+void Connection::write(boost::asio::const_buffer buffer)
+{
+    boost::system::error_code error;
+    std::chrono::steady_clock::duration limit = timeout(error);
+
+    if (!error) {
+        error = boost::asio::error::would_block;
+        boost::asio::async_write(_sock, buffer, [&](const boost::system::error_code& ec, size_t) {
+            error = ec;
+        });
+        wait(limit, error);
+        if (!error)
+            account(buffer.size(), error);
+    }
+    if (error)
+        throw boost::system::system_error(error);
+}
+
+
+/*
+* time that the next operation may take: the idle timeout, capped by the phase deadline
+*/
+std::chrono::steady_clock::duration Connection::timeout(boost::system::error_code& error)
+{
+    std::chrono::steady_clock::duration left = _deadline - std::chrono::steady_clock::now();
+
+    if (_evicted)
+        error = boost::asio::error::timed_out;
+    else if (left <= std::chrono::steady_clock::duration::zero() && _header)
+        evict(evictedHeader, "header timeout", error);
+    else if (left <= std::chrono::steady_clock::duration::zero())
+        evict(evictedDeadline, "session deadline passed", error);
+    return std::min(_idle, left);
+}
+
+
+/*
+* run the io_context until the pending socket operation completes or the timer cancels it
+*/
+void Connection::wait(std::chrono::steady_clock::duration limit, boost::system::error_code& error)
+{
+    bool timedOut = false;
+
+    _timer.expires_after(limit);
+    _timer.async_wait([&](const boost::system::error_code& ec) {
+        boost::system::error_code ignored;
+        if (!ec) {
+            timedOut = true;
+            _sock.cancel(ignored);
+        }
+    });
+
+    _io.restart();
+    while (error == boost::asio::error::would_block)
+        _io.run_one();
+
+    // let the timer handler run before its captures go out of scope
+    _timer.cancel();
+    _io.run();
+
+    if (timedOut && error == boost::asio::error::operation_aborted) {
+        if (_header)
+            evict(evictedHeader, "header timeout", error);
+        else if (std::chrono::steady_clock::now() >= _deadline)
+            evict(evictedDeadline, "session deadline passed", error);
+        else
+            evict(evictedIdle, "idle timeout", error);
+    }
+}
+
+
+/*
+* count transferred bytes and evict a client that stays below the minimum rate
+*/
+void Connection::account(size_t length, boost::system::error_code& error)
+{
+    if (!_transferring || _config.minRate == 0)
+        return;
+
+    _transferred += length;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - _transferStart).count();
+    if (elapsed > MIN_RATE_GRACE && _transferred < _config.minRate * elapsed)
+        evict(evictedSlow, "transfer below minimum rate", error);
+}
+
+
+void Connection::evict(std::atomic<uint64_t>& counter, const char* reason, boost::system::error_code& error)
+{
+    if (!_evicted) {
+        _evicted = true;
+        counter++;
+        std::cout << "Evicting client: " << reason << std::endl;
+    }
+    error = boost::asio::error::timed_out;
+}
+
+
+
+/*
+* Infinite loop that listens to incoming client connections on every acceptor shard.
 * once a client is connected, a new thread is created.
 * this thread activates the session function which handles the client's request.
 */
-void server(boost::asio::io_context& io_context, unsigned short port)
+void server(unsigned short port)
 {
-    tcp::acceptor a(io_context, tcp::endpoint(tcp::v4(), port));
-    for (;;)
+    std::vector<std::thread> shards;
+    unsigned acceptors = std::max(1u, _config.acceptors);
+
+#if !defined(SO_REUSEPORT)
+    if (acceptors > 1) {
+        std::cout << "SO_REUSEPORT is not available, using a single acceptor" << std::endl;
+        acceptors = 1;
+    }
+#endif
+
+    // every shard listens on the same port, the kernel spreads the connections between them
+    for (unsigned shard = 1; shard < acceptors; shard++)
+        shards.emplace_back(acceptConnections, shard, port);
+    acceptConnections(0, port);
+
+    for (std::thread& shard : shards)
+        shard.join();
+}
+
+
+/*
+* wait for SIGINT or SIGTERM, then let the commits in flight finish, close the catalog
+* cleanly and exit. a server that stops any other way rebuilds its catalog at the next start
+*/
+void waitForShutdown(TieredStorage* storage)
+{
+    try
+    {
+        blockShutdownSignals(false);
+        boost::asio::io_context io_context;
+        boost::asio::signal_set signals(io_context, SIGINT, SIGTERM);
+        signals.async_wait([](const boost::system::error_code&, int) {});
+        io_context.run();
+
+        std::cout << "Stopping Backup Server" << std::endl;
+        storage->close();
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "Exception in thread, shutdown: " << e.what() << "\n";
+    }
+    std::cout.flush();
+    std::_Exit(0);
+}
+
+
+/*
+* block or unblock SIGINT and SIGTERM in the calling thread. the threads that are started later
+* keep them blocked, so the signals only reach the shutdown thread and don't interrupt the
+* blocking socket calls of the other threads
+*/
+void blockShutdownSignals(bool block)
+{
+#if defined(__linux__)
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(block ? SIG_BLOCK : SIG_UNBLOCK, &set, nullptr);
+#endif
+}
+
+
+/*
+* accept loop of one acceptor shard. the shard has its own io_context and, when there are
+* several shards, its own SO_REUSEPORT listening socket and runs pinned to one CPU.
+* only the accept loop is pinned, the sessions it starts go back to all the CPUs.
+*/
+void acceptConnections(unsigned shard, unsigned short port)
+{
+    try
+    {
+        boost::asio::io_context io_context;
+        tcp::endpoint endpoint(_config.ipv6 ? tcp::v6() : tcp::v4(), port);
+        tcp::acceptor a(io_context);
+
+        if (_config.acceptors > 1)
+            pinThread(shard % std::max(1u, std::thread::hardware_concurrency()));
+
+        a.open(endpoint.protocol());
+        a.set_option(tcp::acceptor::reuse_address(true));
+        if (_config.ipv6)
+            a.set_option(boost::asio::ip::v6_only(false)); // also accept IPv4 clients
+#if defined(SO_REUSEPORT)
+        if (_config.acceptors > 1)
+            a.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#endif
+        a.bind(endpoint);
+        a.listen(_config.backlog);
+
+        for (;;)
+        {
+            std::cout << "\n\n" << "Waiting to accept client connection" << "\n";
+
+
+            // every session runs the async operations of its socket on its own io_context
+            std::shared_ptr<boost::asio::io_context> io = std::make_shared<boost::asio::io_context>();
+            tcp::socket sock = a.accept(*io);
+
+            // every session holds a thread until it ends, past the limit a client is turned away
+            if (_config.maxSessions > 0 && Connection::active >= _config.maxSessions) {
+                Connection::rejected++;
+                std::cout << "Too many sessions, closing the connection" << "\n";
+                boost::system::error_code ignored;
+                sock.close(ignored);
+                continue;
+            }
+            Connection::active++;
+            try {
+                std::thread(session, io, std::move(sock)).detach();
+            }
+            catch (...) {
+                Connection::active--;
+                throw;
+            }
+
+
+            std::cout << "Accepted on shard " << shard << "\n\n";
+        }
+    }
+    catch (std::exception& e)
     {
-        std::cout << "\n\n" << "Waiting to accept client connection" << "\n";
+        std::cerr << "Exception in thread, acceptConnections " << shard << ": " << e.what() << "\n";
+    }
+}
+
+
+#if defined(__linux__)
+static cpu_set_t processCpus; // the CPUs the threads could use before the first one was pinned
+static std::once_flag processCpusSaved;
+#endif
+
+/*
+* bind the calling thread to one CPU
+*/
+void pinThread(unsigned cpu)
+{
+#if defined(__linux__)
+    std::call_once(processCpusSaved, [] { sched_getaffinity(0, sizeof(processCpus), &processCpus); });
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        std::cout << "Cannot pin thread to CPU " << cpu << std::endl;
+#elif defined(_WIN32)
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+#endif
+}
+
+
+/*
+* let a thread that was started by a pinned thread run on all the CPUs of the process again
+*/
+void unpinThread()
+{
+#if defined(__linux__)
+    if (pthread_setaffinity_np(pthread_self(), sizeof(processCpus), &processCpus) != 0)
+        std::cout << "Cannot unpin thread" << std::endl;
+#elif defined(_WIN32)
+    DWORD_PTR processMask, systemMask;
+    if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+        SetThreadAffinityMask(GetCurrentThread(), processMask);
+#endif
+}
+
+
+/*
+* CRC32C (Castagnoli polynomial) lookup tables for the portable slicing-by-8 implementation.
+*/
+static uint32_t crc32cTable[8][256];
+
+static void crc32cInitTables()
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+        crc32cTable[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            crc32cTable[t][i] = (crc32cTable[t - 1][i] >> 8) ^ crc32cTable[0][crc32cTable[t - 1][i] & 0xFF];
+}
+
+static uint32_t crc32cSoftware(uint32_t crc, const uint8_t* data, size_t length)
+{
+    while (length && ((uintptr_t)data & 7)) {
+        crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *data++) & 0xFF];
+        length--;
+    }
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8); // little endian
+        word ^= crc;
+        crc = crc32cTable[7][word & 0xFF] ^
+              crc32cTable[6][(word >> 8) & 0xFF] ^
+              crc32cTable[5][(word >> 16) & 0xFF] ^
+              crc32cTable[4][(word >> 24) & 0xFF] ^
+              crc32cTable[3][(word >> 32) & 0xFF] ^
+              crc32cTable[2][(word >> 40) & 0xFF] ^
+              crc32cTable[1][(word >> 48) & 0xFF] ^
+              crc32cTable[0][word >> 56];
+        data += 8;
+        length -= 8;
+    }
+    while (length--)
+        crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *data++) & 0xFF];
+    return crc;
+}
+
+#if defined(CRC32C_X64)
+/*
+* CRC32C using the SSE4.2 crc32 instruction, 8 bytes at a time.
+*/
+#if defined(__GNUC__)
+__attribute__((target("sse4.2")))
+#endif
+static uint32_t crc32cHardware(uint32_t crc, const uint8_t* data, size_t length)
+{
+    uint64_t crc64 = crc;
+
+    while (length && ((uintptr_t)data & 7)) {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+        length--;
+    }
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        length -= 8;
+    }
+    while (length--)
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+    return (uint32_t)crc64;
+}
+#endif
+
+/*
+* pick the fastest CRC32C implementation that the cpu supports. called once at startup.
+*/
+static uint32_t (*crc32cSelect())(uint32_t, const uint8_t*, size_t)
+{
+    crc32cInitTables();
+#if defined(CRC32C_X64) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    if (info[2] & (1 << 20))
+        return crc32cHardware;
+#elif defined(CRC32C_X64) && defined(__GNUC__)
+    if (__builtin_cpu_supports("sse4.2"))
+        return crc32cHardware;
+#endif
+    return crc32cSoftware;
+}
 
+static uint32_t (*crc32cImpl)(uint32_t, const uint8_t*, size_t) = crc32cSelect();
 
-        std::thread(session, a.accept()).detach();
 
+/*
+* continue the CRC32C of a stream with the next length bytes.
+* start with crc = 0.
+*/
+uint32_t crc32c(uint32_t crc, const uint8_t* data, size_t length)
+{
+    return ~crc32cImpl(~crc, data, length);
+}
+
+
+/*
+* save the checksum of the file at the given path in its sidecar file.
+*/
+bool writeChecksumFile(std::string path, uint32_t crc)
+{
+    std::ofstream file(path + CHECKSUM_FILE_EXT, std::ios::out | std::ios::trunc);
 
-        std::cout << "Accepted " << "\n\n";
+    if (!file) {
+        std::cerr << "Error creating checksum file for: " << path << "\n";
+        return false;
     }
+    file << std::hex << std::setw(8) << std::setfill('0') << crc << std::endl;
+    return (bool)file;
+}
+
+
+/*
+* flush a file, or the entries of a directory, to the disk. false when it cannot be synced
+*/
+bool syncFile(const std::string& path)
+{
+#if defined(__linux__)
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool synced = fsync(fd) == 0;
+    ::close(fd);
+    return synced;
+#else
+    (void)path;
+    return true;
+#endif
+}
+
+
+/*
+* load the checksum of the file at the given path from its sidecar file.
+* return false if the file has no checksum.
+*/
+bool readChecksumFile(std::string path, uint32_t* crc)
+{
+    std::ifstream file(path + CHECKSUM_FILE_EXT);
+
+    if (!file)
+        return false;
+    file >> std::hex >> *crc;
+    return !file.fail();
 }
 
 
@@ -792,20 +3999,118 @@ void clear_buffer(uint8_t * buf, uint32_t length) {
 }
 
 
+/*
+* fill _config from the command line.
+* return false if the arguments are not valid.
+*/
+bool parseArgs(int argc, char* argv[])
+{
+    if (argc < 2)
+        return false;
+
+    _config.port = (unsigned short)std::atoi(argv[1]);
+    if (_config.port == 0)
+        return false;
+
+    for (int i = 2; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "--rebuild-catalog") {
+            _config.rebuildCatalog = true;
+            continue;
+        }
+        if (arg == "--ipv6") {
+            _config.ipv6 = true;
+            continue;
+        }
+
+        if (i + 1 >= argc)
+            return false;
+
+        if (arg == "--root")
+            _config.root = argv[++i];
+        else if (arg == "--layout") {
+            std::string layout = argv[++i];
+            if (layout != "flat" && layout != "sharded")
+                return false;
+            _config.sharded = (layout == "sharded");
+        }
+        else if (arg == "--packed-max")
+            _config.packedFileMax = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--reclaim-rate")
+            _config.reclaimRate = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--cache-size")
+            _config.cacheSize = (uint64_t)std::strtoull(argv[++i], nullptr, 10) * 1024 * 1024;
+        else if (arg == "--header-timeout")
+            _config.headerTimeout = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--idle-timeout")
+            _config.idleTimeout = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--transfer-timeout")
+            _config.transferTimeout = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--min-rate")
+            _config.minRate = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--acceptors")
+            _config.acceptors = (unsigned)std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--backlog")
+            _config.backlog = std::atoi(argv[++i]);
+        else if (arg == "--max-sessions")
+            _config.maxSessions = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--keep-last")
+            _config.keepLast = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--keep-daily")
+            _config.keepDaily = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        else
+            return false;
+    }
+    return true;
+}
+
+
 int main(int argc, char* argv[])
 {
     try
     {
-        if (argc != 2)
+        if (!parseArgs(argc, argv))
         {
-            std::cerr << "Usage: blocking_tcp_echo_server <port>\n";
+            std::cerr << "Usage: server <port> [--root <dir>] [--layout flat|sharded] [--packed-max <bytes>] [--rebuild-catalog] [--reclaim-rate <files/sec>] [--cache-size <MB>] [--header-timeout <sec>] [--idle-timeout <sec>] [--transfer-timeout <sec>] [--min-rate <bytes/sec>] [--acceptors <n>] [--ipv6] [--backlog <n>] [--max-sessions <n>] [--keep-last <n>] [--keep-daily <days>]\n";
             return 1;
         }
         std::cout << "Starting Backup Server" << std::endl;
+        blockShutdownSignals(true);
+
+        boost::filesystem::create_directories(_config.root);
+        std::cout << "Storage root: " << _config.root << (_config.sharded ? " (sharded)" : " (flat)") << std::endl;
+        if (_config.sharded)
+            migrateClients(_config.root);
+
+        // open the catalog, or rebuild it from the storage root when it is missing or damaged
+        std::string catalogPath = joinPath(_config.root, CATALOG_FILE);
+        _catalog = new Catalog;
+        _cache = new FileCache(_config.cacheSize);
+        TieredStorage* storage = new TieredStorage(_config.packedFileMax, _catalog, _config.reclaimRate, _config.keepLast, _config.keepDaily);
+        _storage = storage;
+
+        bool catalogOpen = !_config.rebuildCatalog && _catalog->open(catalogPath);
+
+        // erases that were not reclaimed before the last shutdown are finished first
+        if (!storage->openReclaimLog(joinPath(_config.root, RECLAIM_LOG), catalogOpen))
+            throw std::runtime_error("Cannot open reclaim log");
+
+        if (!catalogOpen) {
+            std::cout << "Rebuilding catalog " << catalogPath << std::endl;
+            if (!_catalog->create(catalogPath))
+                throw std::runtime_error("Cannot create catalog");
+            storage->rebuildCatalog(_config.root);
+        }
+        else if (_catalog->needsCompaction()) {
+            _catalog->compact();
+        }
+        storage->start();
+        std::thread(waitForShutdown, storage).detach();
 
 
-        boost::asio::io_context io_context;
-        server(io_context, std::atoi(argv[1]));
+        server(_config.port);
     }
     catch (std::exception& e)
     {
@@ -7,9 +7,14 @@
 
 /* possible operation requests */
 #define BACKUP_FILE (100)
+#define BACKUP_FILE_CHECKED (101) // BACKUP_FILE whose payload is followed by the CRC32C of the file, computed by the client
 #define GET_FILE (200)
 #define ERASE_FILE (201)
 #define GET_BACKUP_LIST (202)
+#define VERIFY_BACKUP (203)
+#define ERASE_FILES (204) // erase a list of files (payload) or all the files with a prefix (filename)
+#define GET_SERVER_STATS (205)
+#define GET_FILE_VERSIONS (206) // list the kept versions of a file, newest first
 
 
 /* return codes*/
@@ -17,24 +22,154 @@
 #define GET_BACKUP_LIST_SUCCESS (211)  // get list of backed files was successful
 #define BACKUP_FILE_SUCCESS (212) // backup of file was successful
 #define ERASE_FILE_SUCCESS (212) // erase of file was successful
+#define VERIFY_BACKUP_SUCCESS (213) // all the files in client's directory match their checksums
+#define GET_SERVER_STATS_SUCCESS (214) // the payload holds the server's metrics, one "name value" per line
+#define GET_FILE_VERSIONS_SUCCESS (215) // the payload holds one "version size crc32c" per line
 #define FILE_NOT_FOUND (1001) // backup directory does not have this file
 #define NO_FILES_FOR_CLIENT (1002) // backup directory for this user is empty
 #define GENERAL_ERROR (1003) // general problem with the server
+#define CHECKSUM_MISMATCH (1004) // at least one file in client's directory does not match its checksum
 
 
 /* maximum size of chunk to read from client's request message */
 #define MAX_LENGTH (1024)
 
+/* size of chunk to read when scanning backed up files on the server's disk */
+#define FILE_IO_CHUNK (64 * 1024)
+
+/* largest list of filenames that is accepted in an ERASE_FILES request */
+#define ERASE_LIST_MAX_SIZE (16 * 1024 * 1024)
+
+/* default size of the in-memory cache of restored files, in MB.
+   it can be changed at runtime with --cache-size (0 disables the cache) */
+#define CACHE_SIZE (256)
+
+/* the cache is split into this many independently locked shards */
+#define CACHE_SHARDS (16)
+
+/* large restores ask the kernel to read this many bytes ahead of the reader */
+#define READAHEAD_WINDOW (8 * 1024 * 1024)
+
+/* default number of files per second that the background reclaimer deletes from the disk.
+   it can be changed at runtime with --reclaim-rate (0 means no limit) */
+#define RECLAIM_RATE (200)
+
+/* default deadlines of a client session, in seconds. they can be changed at runtime with
+   --header-timeout, --idle-timeout and --transfer-timeout */
+#define HEADER_TIMEOUT (10) // to receive the request header
+#define IDLE_TIMEOUT (30) // without progress between two chunks of a transfer
+#define TRANSFER_TIMEOUT (4 * 3600) // for the whole request, from header to response
+
+/* default slowest transfer that is allowed, in bytes per second (--min-rate, 0 disables it).
+   it is enforced after the first MIN_RATE_GRACE seconds of the transfer */
+#define MIN_RATE (1024)
+#define MIN_RATE_GRACE (10)
+
+/* default most sessions that run at the same time (--max-sessions, 0 for no limit).
+   every session has its own thread, a connection over the limit is closed right away */
+#define MAX_SESSIONS (1024)
+
 /* exact amount of bytes in header without filename */
 #define HEADER_SIZE (8)
 
-/* server's and client's version */
-#define VERSION_SERVER (1)
-#define VERSION_CLIENT (1)
+/* server's and client's version. version 2 added the as-of field to the header of GET_FILE,
+   the CRC32C after the payload of GET_FILE, the CRC32C in the size field of the BACKUP_FILE
+   response and response headers that always end with the size field.
+   requests of older clients are still served in the format of their version */
+#define VERSION_SERVER (2)
+#define VERSION_CLIENT (2)
+#define VERSION_CLIENT_MIN (1) // oldest client version that is served
+
+/* every backed up file has a sidecar file with this extension that holds its CRC32C (8 hex digits) */
+#define CHECKSUM_FILE_EXT (".crc32c")
 
-/* the path to the parent directory that holds backup directories for all the clients */
-/* this path is within the directory of the server.exe */
+/* size of the CRC32C that is appended after the payload of a GET_FILE response */
+#define CHECKSUM_SIZE (4)
+
+/* default path to the parent directory that holds backup directories for all the clients */
+/* it can be changed at runtime with --root */
+#ifdef _WIN32
 #define SERVER_BACKUP_PARENT_DIR ("C:\\backup_svr\\")
+#else
+#define SERVER_BACKUP_PARENT_DIR ("backup_svr")
+#endif
+
+/* longest filename that is accepted from a client */
+#define MAX_FILENAME_LENGTH (255)
+
+/* files up to this size are packed into the client's segment files instead of getting a file of their own.
+   it can be changed at runtime with --packed-max (0 disables packing) */
+#define PACKED_FILE_MAX_SIZE (4096)
+
+/* name of the directory inside the client's directory that holds the segment files and their index */
+#define SEGMENT_DIR (".segments")
+
+/* a new segment file is started once the active one would grow beyond this size */
+#define SEGMENT_MAX_SIZE (64 * 1024 * 1024)
+
+/* how often the compactor looks for segments to reclaim, in seconds */
+#define COMPACT_INTERVAL (60)
+
+/* a sealed segment is rewritten when less than this percentage of its bytes is still live */
+#define COMPACT_LIVE_PERCENT (50)
+
+/* types of the records in a segment index */
+#define SEGMENT_RECORD_PUT (1)
+#define SEGMENT_RECORD_TOMBSTONE (2)
+
+/* name of the catalog file inside the storage root */
+#define CATALOG_FILE (".catalog")
+
+/* name of the log of erased files whose data was not deleted yet, in the storage root */
+#define RECLAIM_LOG (".reclaim")
+
+/* catalog file format */
+#define CATALOG_MAGIC (0x54434B42) // "BKCT"
+#define CATALOG_VERSION (1)
+#define CATALOG_BUCKETS (1 << 18) // must be a power of 2
+#define CATALOG_INITIAL_DATA (1024 * 1024) // room for records in a new catalog file
+
+/* where a file in the catalog is stored */
+#define LOCATION_FILE (1)
+#define LOCATION_SEGMENT (2)
+
+/* directory in each client directory that holds the older versions of the files */
+#define VERSIONS_DIR (".versions")
+
+/* name of the copy of a replaced file while its new backup is committed, in the file's versions directory */
+#define VERSION_STAGED (".staged")
+
+/* default retention of older versions: the last KEEP_LAST versions of a file (the current one
+   included) and the last version of each of the last KEEP_DAILY days (UTC) are kept.
+   they can be changed at runtime with --keep-last and --keep-daily */
+#define KEEP_LAST (10)
+#define KEEP_DAILY (7)
+
+/* seconds between two sweeps of the pruner over all the kept versions */
+#define PRUNE_INTERVAL (3600)
+
+
+/* runtime configuration of the server, filled from the command line */
+struct Config
+{
+	unsigned short port = 0;
+	std::string root = SERVER_BACKUP_PARENT_DIR; // storage root
+	bool sharded = true; // client directories are placed in <root>/ab/cd/<userid>
+	uint32_t packedFileMax = PACKED_FILE_MAX_SIZE; // largest file that goes to the segment storage
+	bool rebuildCatalog = false; // rebuild the catalog from the storage root at startup
+	uint32_t reclaimRate = RECLAIM_RATE; // files per second deleted by the background reclaimer
+	uint64_t cacheSize = (uint64_t)CACHE_SIZE * 1024 * 1024; // byte budget of the restore cache
+	uint32_t headerTimeout = HEADER_TIMEOUT;
+	uint32_t idleTimeout = IDLE_TIMEOUT;
+	uint32_t transferTimeout = TRANSFER_TIMEOUT;
+	uint32_t minRate = MIN_RATE;
+	unsigned acceptors = 1; // listening sockets on the same port (SO_REUSEPORT), each on its own thread
+	bool ipv6 = false; // listen on a dual-stack IPv6 socket
+	int backlog = boost::asio::socket_base::max_listen_connections; // pending connections queue
+	uint32_t maxSessions = MAX_SESSIONS;
+	uint32_t keepLast = KEEP_LAST;
+	uint32_t keepDaily = KEEP_DAILY;
+};
 
 
 /*  client's request message */
@@ -68,5 +203,384 @@ struct Response
 };
 
 
+/*  streams one file into a storage backend. nothing is visible to readers until commit()
+    succeeds. destroying the writer without committing discards the data */
+class StorageWriter
+{
+public:
+	virtual ~StorageWriter() {}
+	virtual bool write(const uint8_t* data, size_t length) = 0;
+	virtual bool commit(uint32_t crc) = 0;
+};
+
+
+/*  streams one backed up file out of a storage backend */
+class StorageReader
+{
+public:
+	virtual ~StorageReader() {}
+	virtual uint32_t size() = 0;
+	virtual bool checksum(uint32_t* crc) = 0; // checksum recorded at backup time. false if there is none
+	virtual size_t read(uint8_t* data, size_t length) = 0; // returns 0 at the end of the file
+};
+
+
+/*  one kept version of a backed up file. the version is the time of the backup */
+struct FileVersion
+{
+	int64_t version = 0; // seconds since the epoch
+	uint32_t sequence = 0; // orders the versions that were kept within the same second
+	uint64_t size = 0;
+	uint32_t crc = 0;
+};
+
+
+/*  the way the backed up files are kept on the server's disk.
+    backupFile, retrieveFileFromBackup and eraseFile only talk to the storage through this interface */
+class StorageBackend
+{
+public:
+	virtual ~StorageBackend() {}
+	virtual std::unique_ptr<StorageWriter> create(uint32_t userID, const std::string& filename, uint32_t size) = 0;
+	virtual std::unique_ptr<StorageReader> open(uint32_t userID, const std::string& filename) = 0;
+	virtual uint16_t erase(uint32_t userID, const std::string& filename) = 0;
+	virtual std::vector<std::string> list(uint32_t userID) = 0;
+
+	// backends that keep older versions of the files override these
+	virtual std::vector<FileVersion> versions(uint32_t /*userID*/, const std::string& /*filename*/) { return {}; }
+	virtual std::unique_ptr<StorageReader> openVersion(uint32_t /*userID*/, const std::string& /*filename*/, int64_t /*asOf*/) { return nullptr; }
+};
+
+
+/*  reader over a file that is already in memory */
+class BufferReader : public StorageReader
+{
+public:
+	BufferReader(std::shared_ptr<const std::vector<uint8_t>> data, uint32_t crc);
+	uint32_t size() override;
+	bool checksum(uint32_t* crc) override;
+	size_t read(uint8_t* data, size_t length) override;
+private:
+	std::shared_ptr<const std::vector<uint8_t>> _data;
+	size_t _offset = 0;
+	uint32_t _crc = 0;
+};
+
+
+/*  every backed up file is a file of its own in the client's directory,
+    next to a sidecar file that holds its checksum */
+class FileStorage : public StorageBackend
+{
+public:
+	std::unique_ptr<StorageWriter> create(uint32_t userID, const std::string& filename, uint32_t size) override;
+	std::unique_ptr<StorageReader> open(uint32_t userID, const std::string& filename) override;
+	uint16_t erase(uint32_t userID, const std::string& filename) override;
+	std::vector<std::string> list(uint32_t userID) override;
+};
+
+
+/*  location of a packed file inside the client's segment files */
+struct SegmentEntry
+{
+	uint32_t segment = 0;
+	uint64_t offset = 0;
+	uint32_t length = 0;
+	uint32_t crc = 0;
+};
+
+
+/*  in-memory state of the segment files of one client */
+struct SegmentClient
+{
+	std::mutex lock;
+	bool loaded = false;
+	std::string dir; // <client's directory>/.segments
+	std::map<std::string, SegmentEntry> index; // live files
+	std::map<uint32_t, uint64_t> totalBytes; // bytes of indexed files written to each segment
+	std::map<uint32_t, uint64_t> liveBytes; // bytes of each segment that are still referenced by index
+	uint32_t active = 1; // segment that new files are appended to
+	uint64_t activeSize = 0;
+	uint64_t records = 0; // number of records in the index log
+	std::ofstream segmentOut; // append handle of the active segment
+	std::ofstream indexOut; // append handle of the index log
+	std::ifstream segmentIn; // read handle of the last segment that was read from
+	uint32_t segmentInId = 0;
+};
+
+
+/*  small files are appended to large per-client segment files. an append-only index log
+    records (segment, offset, length, checksum) for every file. erasing a file appends a
+    tombstone, and a background compactor moves the live files out of mostly dead segments
+    and deletes them */
+class SegmentStorage : public StorageBackend
+{
+public:
+	std::unique_ptr<StorageWriter> create(uint32_t userID, const std::string& filename, uint32_t size) override;
+	std::unique_ptr<StorageReader> open(uint32_t userID, const std::string& filename) override;
+	uint16_t erase(uint32_t userID, const std::string& filename) override;
+	std::vector<std::string> list(uint32_t userID) override;
+
+	bool put(uint32_t userID, const std::string& filename, const std::vector<uint8_t>& data, uint32_t crc);
+	std::map<std::string, SegmentEntry> entries(uint32_t userID);
+	void drop(uint32_t userID);
+	void startCompactor();
+
+private:
+	SegmentClient* client(uint32_t userID);
+	bool load(uint32_t userID, SegmentClient* c);
+	bool appendData(SegmentClient* c, const uint8_t* data, uint32_t length, uint32_t crc, SegmentEntry* entry);
+	bool appendRecord(SegmentClient* c, uint8_t type, const std::string& filename, const SegmentEntry& entry);
+	void setEntry(SegmentClient* c, const std::string& filename, const SegmentEntry& entry);
+	bool readEntry(SegmentClient* c, const SegmentEntry& entry, std::vector<uint8_t>& data);
+	bool rewriteIndex(SegmentClient* c);
+	void compact(SegmentClient* c);
+	void compactLoop();
+
+	std::mutex _lock;
+	std::unordered_map<uint32_t, std::unique_ptr<SegmentClient>> _segmentClients;
+};
+
+
+/*  what the catalog knows about one backed up file */
+struct CatalogEntry
+{
+	uint32_t userID = 0;
+	std::string filename = "";
+	uint64_t size = 0;
+	int64_t mtime = 0; // seconds since the epoch
+	uint32_t crc = 0;
+	uint8_t location = 0; // LOCATION_FILE or LOCATION_SEGMENT
+};
+
+
+/*  first bytes of the catalog file. followed by the file bucket table,
+    the user bucket table and the records */
+struct CatalogHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t buckets;
+	uint32_t clean; // 1 after a clean shutdown, 0 while the server runs
+	uint64_t dataStart; // offset of the first record
+	uint64_t dataEnd; // offset after the last record
+	uint64_t liveRecords;
+	uint64_t deadBytes; // bytes of records that were replaced or removed
+	uint64_t padding[2];
+};
+
+
+/*  one record in the catalog file, followed by the filename padded to 8 bytes.
+    records with the same hash of (userid, filename) are chained through nextFile,
+    records with the same hash of userid through nextUser. newest first */
+struct CatalogRecord
+{
+	uint64_t nextFile;
+	uint64_t nextUser;
+	uint32_t userID;
+	uint8_t live;
+	uint8_t location;
+	uint16_t nameLen;
+	uint64_t size;
+	int64_t mtime;
+	uint32_t crc;
+	uint32_t reserved;
+};
+
+
+/*  persistent, memory mapped catalog of all the backed up files (userid -> files -> size, mtime,
+    checksum, location). opening it only maps the file, and lookups follow a short hash chain
+    instead of walking directories. new records are appended, replaced ones are only marked dead
+    and dropped by compact() */
+class Catalog
+{
+public:
+	bool open(const std::string& path);
+	bool create(const std::string& path);
+	void close();
+	bool compact();
+
+	bool put(const CatalogEntry& entry);
+	bool lookup(uint32_t userID, const std::string& filename, CatalogEntry* entry);
+	bool remove(uint32_t userID, const std::string& filename);
+	std::vector<std::string> list(uint32_t userID);
+	bool hasUser(uint32_t userID);
+	bool needsCompaction();
+
+private:
+	bool map();
+	bool grow(uint64_t needed);
+	CatalogHeader* header();
+	uint64_t* fileBuckets();
+	uint64_t* userBuckets();
+	CatalogRecord* record(uint64_t offset);
+	uint64_t findLive(uint32_t userID, const std::string& filename);
+	void markDead(uint64_t offset);
+
+	std::string _path;
+	boost::interprocess::file_mapping _file;
+	boost::interprocess::mapped_region _region;
+	std::shared_mutex _lock;
+};
+
+
+/*  a file that was erased from the catalog and still has to be deleted from its tier */
+struct ReclaimJob
+{
+	uint32_t userID = 0;
+	std::string filename = "";
+	uint8_t location = 0;
+};
+
+
+/*  older versions of the backed up files, in <client dir>/.versions/<filename>/<version>.
+    a version is taken when a backup replaces the file. a file of the file storage is replaced
+    by a rename, so a hard link to it keeps the old data without copying it */
+class VersionStore
+{
+public:
+	std::string stage(const CatalogEntry& entry, StorageBackend* from);
+	bool keep(const CatalogEntry& entry, const std::string& staged);
+	void drop(const std::string& staged);
+	std::vector<FileVersion> list(uint32_t userID, const std::string& filename);
+	std::unique_ptr<StorageReader> open(uint32_t userID, const std::string& filename, int64_t asOf);
+	size_t prune(uint32_t userID, const std::string& filename, int64_t current, uint32_t keepLast, uint32_t keepDaily);
+	void erase(uint32_t userID, const std::string& filename);
+	std::vector<std::string> files(uint32_t userID);
+
+private:
+	std::string dir(uint32_t userID, const std::string& filename);
+	std::string path(uint32_t userID, const std::string& filename, const FileVersion& version);
+};
+
+
+/*  files up to packedFileMax bytes go to the segment storage, all the others to the file storage.
+    the catalog records where every file went, so reads, erases and lists never probe the disk.
+    erase only drops the file from the catalog; a rate limited background reclaimer deletes the data */
+class TieredStorage : public StorageBackend
+{
+public:
+	TieredStorage(uint32_t packedFileMax, Catalog* catalog, uint32_t reclaimRate, uint32_t keepLast, uint32_t keepDaily);
+	std::unique_ptr<StorageWriter> create(uint32_t userID, const std::string& filename, uint32_t size) override;
+	std::unique_ptr<StorageReader> open(uint32_t userID, const std::string& filename) override;
+	uint16_t erase(uint32_t userID, const std::string& filename) override;
+	std::vector<std::string> list(uint32_t userID) override;
+	std::vector<FileVersion> versions(uint32_t userID, const std::string& filename) override;
+	std::unique_ptr<StorageReader> openVersion(uint32_t userID, const std::string& filename, int64_t asOf) override;
+
+	void start();
+	void rebuildCatalog(const std::string& root);
+	bool openReclaimLog(const std::string& path, bool catalogOpen);
+	void cancelReclaim(uint32_t userID, const std::string& filename);
+	std::mutex& commitLock(uint32_t userID);
+	std::string stageVersion(const CatalogEntry& replaced);
+	void keepVersion(const CatalogEntry& replaced, const std::string& staged);
+	void dropVersion(const std::string& staged);
+	void rollback(const CatalogEntry& entry, const CatalogEntry* replaced, const std::string& staged);
+	void close();
+
+private:
+	StorageBackend* tier(uint8_t location);
+	void addToCatalog(uint32_t userID);
+	void reclaim(const ReclaimJob& job);
+	void reclaimLoop();
+	void logReclaim(char type, uint32_t userID, const std::string& filename);
+	void pruneLoop();
+
+	FileStorage _files;
+	SegmentStorage _segments;
+	VersionStore _versions;
+	uint32_t _packedFileMax;
+	Catalog* _catalog;
+
+	std::mutex _commitLocks[64]; // serialize commits with the reclaimer, per client
+	uint32_t _writers[64] = {}; // writers in flight, guarded by the commit lock of the same index
+	std::deque<ReclaimJob> _reclaimQueue;
+	std::mutex _reclaimLock;
+	std::condition_variable _reclaimReady;
+	uint32_t _reclaimRate;
+	std::string _reclaimLogPath;
+	std::ofstream _reclaimLog; // one line per erase and per finished or cancelled erase
+	std::map<std::pair<uint32_t, std::string>, uint32_t> _pendingErases; // queued jobs per file
+
+	std::set<std::pair<uint32_t, std::string>> _pruneQueue; // files that got a new version
+	std::mutex _pruneLock;
+	std::condition_variable _pruneReady;
+	uint32_t _keepLast;
+	uint32_t _keepDaily;
+};
+
+
+/*  bounded, sharded LRU cache of the contents of recently restored files.
+    concurrent requests for a file that is not cached wait for a single read from the disk */
+class FileCache
+{
+public:
+	typedef std::shared_ptr<const std::vector<uint8_t>> Data;
+
+	FileCache(uint64_t budget);
+	bool cacheable(uint64_t size);
+	Data get(const std::string& key, std::function<bool(std::vector<uint8_t>&)> load);
+	std::vector<std::string> stats();
+
+private:
+	struct Shard
+	{
+		std::mutex lock;
+		std::list<std::pair<std::string, Data>> lru; // most recently used first
+		std::unordered_map<std::string, std::list<std::pair<std::string, Data>>::iterator> entries;
+		std::unordered_map<std::string, std::shared_future<Data>> loading; // reads in progress
+		uint64_t bytes = 0;
+	};
+
+	Shard _shards[CACHE_SHARDS];
+	uint64_t _shardBudget;
+	std::atomic<uint64_t> _hits;
+	std::atomic<uint64_t> _misses;
+	std::atomic<uint64_t> _coalesced;
+	std::atomic<uint64_t> _evictions;
+};
+
+
+/*  a client connection. reads and writes are asio async operations that run on the
+    session's own io_context, each one raced against a steady timer, so a client that
+    stalls or trickles is evicted instead of holding its thread and partial file forever */
+class Connection
+{
+public:
+	Connection(boost::asio::io_context& io, boost::asio::ip::tcp::socket sock);
+	~Connection();
+	void setDeadline(uint32_t idle, uint32_t total, bool header = false);
+	void startTransfer();
+	void unread(const uint8_t* data, size_t length);
+	size_t readSome(boost::asio::mutable_buffer buffer, boost::system::error_code& error);
+	void write(boost::asio::const_buffer buffer);
+
+	static std::atomic<uint64_t> active; // counted from the accept on, so the acceptors can keep the limit
+	static std::atomic<uint64_t> rejected;
+	static std::atomic<uint64_t> evictedHeader;
+	static std::atomic<uint64_t> evictedIdle;
+	static std::atomic<uint64_t> evictedDeadline;
+	static std::atomic<uint64_t> evictedSlow;
+
+private:
+	std::chrono::steady_clock::duration timeout(boost::system::error_code& error);
+	void wait(std::chrono::steady_clock::duration timeout, boost::system::error_code& error);
+	void account(size_t length, boost::system::error_code& error);
+	void evict(std::atomic<uint64_t>& counter, const char* reason, boost::system::error_code& error);
+
+	boost::asio::io_context& _io;
+	boost::asio::ip::tcp::socket _sock;
+	boost::asio::steady_timer _timer;
+	std::vector<uint8_t> _pending; // bytes that were read ahead of the current request field
+	std::chrono::steady_clock::duration _idle;
+	std::chrono::steady_clock::time_point _deadline;
+	std::chrono::steady_clock::time_point _transferStart;
+	uint64_t _transferred = 0;
+	bool _transferring = false;
+	bool _header = false; // the request header is being read
+	bool _evicted = false;
+};
+
+
 #endif /* server.h */
 